@@ -119,6 +119,59 @@ bool get_connectivity_matrix(tipl::program_option<tipl::out>& po,
                              std::shared_ptr<fib_data> handle,
                              std::string output_name,
                              std::shared_ptr<TractModel> tract_model);
+// waits for tracking to end, returns false if tracking is terminated due to a low yield rate
+bool wait_for_tracking(ThreadData& thread,tipl::progress& prog2,size_t yield_check_count,float yield_rate)
+{
+    bool no_result = false;
+    while(!thread.is_ended() && !prog2.aborted())
+    {
+        std::this_thread::yield();
+        if(!thread.param.termination_count)
+        {
+            prog2(0,1);
+            continue;
+        }
+        prog2(thread.get_total_tract_count(),thread.param.termination_count);
+        // terminate if yield rate is very low, likely quality problem
+        if(thread.get_total_seed_count() > yield_check_count &&
+           thread.get_total_tract_count() < float(thread.get_total_seed_count())*yield_rate)
+        {
+            tipl::out() << "low yield rate (" << thread.get_total_tract_count() << "/" <<
+                                thread.get_total_seed_count() << "), terminating" << std::endl;
+            no_result = true;
+            thread.end_thread();
+            break;
+        }
+    }
+
+    float sec = float(std::chrono::duration_cast<std::chrono::milliseconds>(
+                thread.end_time-thread.begin_time).count())*0.001f;
+    if(thread.get_total_seed_count())
+    {
+        tipl::out() << "yield rate (tract generated per seed): " <<
+                float(thread.get_total_tract_count())/float(thread.get_total_seed_count()) << std::endl;
+        tipl::out() << "tract yield rate (tracts per second): " <<
+                                   float(thread.get_total_tract_count())/sec << std::endl;
+        tipl::out() << "seed yield rate (seeds per second): " <<
+                                   float(thread.get_total_seed_count())/sec << std::endl;
+    }
+    return !no_result;
+}
+
+struct auto_track_files{
+    std::string output_path,no_result,trk,template_trk,stat;
+    auto_track_files(const std::string& dir,const std::string& fib_file_name,const std::string& tract_name,
+                     const std::string& trk_format,const std::string& stat_format)
+    {
+        std::string fib_base = QFileInfo(fib_file_name.c_str()).baseName().toStdString();
+        output_path = dir + "/" + tract_name;
+        no_result = output_path + "/" + fib_base+"."+tract_name+".no_result.txt";
+        trk = output_path + "/" + fib_base+"."+tract_name+ "." + trk_format;
+        template_trk = output_path + "/T_" + fib_base+"."+tract_name + "." + trk_format;
+        stat = output_path + "/" + fib_base+"."+tract_name+"." + stat_format;
+    }
+};
+
 std::string run_auto_track(tipl::program_option<tipl::out>& po,const std::vector<std::string>& file_list,int& prog)
 {
     std::string tolerance_string = po.get("tolerance","22,26,30");
@@ -132,6 +185,7 @@ std::string run_auto_track(tipl::program_option<tipl::out>& po,const std::vector
     uint32_t thread_count = tipl::max_thread_count = po.get("thread_count",tipl::max_thread_count);
     std::string trk_format = po.get("trk_format","tt.gz");
     std::string stat_format = po.get("stat_format","stat.txt");
+    bool single_pass = po.get("single_pass",0);
     std::vector<float> tolerance;
     {
         std::istringstream in(tolerance_string);
@@ -201,6 +255,172 @@ std::string run_auto_track(tipl::program_option<tipl::out>& po,const std::vector
     std::vector<std::vector<std::string> > stat_files(tract_name_list.size());
     std::string dir = po.get("output",QFileInfo(file_list.front().c_str()).absolutePath().toStdString());
 
+    // track all bundles in one whole-brain run and assign each streamline to its nearest atlas bundle.
+    // bundles without results are left to the per-bundle tracking, which retries larger tolerances.
+    auto track_bundles_at_once = [&](std::shared_ptr<fib_data> handle,const std::string& fib_file_name,
+                                     const std::vector<size_t>& bundles,std::vector<char>& tracked)->std::string
+    {
+        if(!handle->load_track_atlas())
+            return handle->error_msg + " at " + fib_file_name;
+        if (po.has("threshold_index") && !handle->dir.set_tracking_index(po.get("threshold_index")))
+            return std::string("invalid threshold index");
+
+        std::vector<std::string> names;
+        std::vector<std::pair<float,float> > length_range;
+        for(auto j : bundles)
+        {
+            names.push_back(tract_name_list[j]);
+            auto minmax = handle->get_track_minmax_length(tract_name_list[j]);
+            length_range.push_back(std::make_pair(
+                handle->vs[0]*std::max<float>(tolerance[0],minmax.first-2.0f*tolerance[0])/handle->tract_atlas_jacobian,
+                handle->vs[0]*(minmax.second+2.0f*tolerance[0])/handle->tract_atlas_jacobian));
+        }
+
+        ThreadData thread(handle);
+        {
+            thread.param.default_otsu = po.get("otsu_threshold",thread.param.default_otsu);
+            thread.param.threshold = po.get("fa_threshold",thread.param.threshold);
+            thread.param.cull_cos_angle = float(std::cos(po.get("turning_angle",0.0)*3.14159265358979323846/180.0));
+            thread.param.step_size = po.get("step_size",thread.param.step_size);
+            thread.param.smooth_fraction = po.get("smoothing",thread.param.smooth_fraction);
+            thread.param.min_length = length_range[0].first;
+            thread.param.max_length = length_range[0].second;
+            for(const auto& range : length_range)
+            {
+                thread.param.min_length = std::min<float>(thread.param.min_length,range.first);
+                thread.param.max_length = std::max<float>(thread.param.max_length,range.second);
+            }
+            tipl::out() << "min_length(mm): " << thread.param.min_length << std::endl;
+            tipl::out() << "max_length(mm): " << thread.param.max_length << std::endl;
+            thread.param.tip_iteration = po.get("tip_iteration",32);
+            thread.param.check_ending = po.get("check_ending",1);
+            thread.param.stop_by_tract = 1;
+            thread.param.termination_count = 0;
+        }
+        {
+            thread.roi_mgr->use_auto_track = true;
+            // termination count uses the sum of the bundle seed regions (see RoiMgr::setAtlas)
+            thread.roi_mgr->track_voxel_ratio = track_voxel_ratio;
+            thread.roi_mgr->tract_names = names;
+            thread.roi_mgr->tolerance_dis_in_icbm152_mm = tolerance[0];
+        }
+        tipl::out() << "tracking " << names.size() << " bundles in a single pass";
+        tipl::progress prog2("tracking all bundles",true);
+        thread.run(thread_count,false);
+        std::string report = handle->report;
+        report += thread.report.str();
+        auto_track_report = report;
+        bool no_result = !wait_for_tracking(thread,prog2,yield_check_count,yield_rate);
+        if(prog2.aborted())
+            return std::string("aborted.");
+        if(no_result)
+            return std::string();
+
+        // the nearest atlas cluster of each track is kept from the check during tracking
+        TractModel all_tracts(handle);
+        std::vector<unsigned int> nearest_cluster;
+        thread.fetchTracks(&all_tracts,&nearest_cluster);
+        thread.fetchTracks(&all_tracts,&nearest_cluster);
+        const auto& tracts = all_tracts.get_tracts();
+        if(nearest_cluster.size() != tracts.size())
+            return std::string("inconsistent cluster labels in single-pass tracking");
+
+        // atlas clusters of each bundle and the bundle-specific ROI/ROA
+        std::vector<std::vector<uint32_t> > cluster_bundles(handle->tractography_name_list.size());
+        std::vector<std::shared_ptr<RoiMgr> > bundle_regions(bundles.size());
+        for(uint32_t b = 0;b < bundles.size();++b)
+        {
+            bundle_regions[b] = std::make_shared<RoiMgr>(handle);
+            bundle_regions[b]->tract_name = names[b];
+            if(!bundle_regions[b]->setAtlasRegions())
+                continue;
+            for(auto id : handle->get_track_ids(names[b]))
+                cluster_bundles[id].push_back(b);
+        }
+
+        std::vector<std::vector<std::vector<uint32_t> > > bundle_tracts_threads(tipl::max_thread_count);
+        tipl::par_for<tipl::sequential_with_id>(tracts.size(),[&](size_t i,unsigned int id)
+        {
+            const auto& t = tracts[i];
+            auto nearest = nearest_cluster[i];
+            if(nearest >= cluster_bundles.size())
+                return;
+            float length = all_tracts.get_tract_length_in_mm(uint32_t(i));
+            auto& bundle_tracts = bundle_tracts_threads[id];
+            for(auto b : cluster_bundles[nearest])
+                if(length >= length_range[b].first && length <= length_range[b].second &&
+                   bundle_regions[b]->fulfill_regions(&t[0],uint32_t(t.size())))
+                {
+                    if(bundle_tracts.empty())
+                        bundle_tracts.resize(bundles.size());
+                    bundle_tracts[b].push_back(uint32_t(i));
+                }
+        });
+
+        // trim and remove repeated tracts of each bundle. these calls use par_for and progress
+        // internally, so bundles are processed one at a time
+        std::vector<std::shared_ptr<TractModel> > tract_models(bundles.size());
+        for(size_t b = 0;b < bundles.size();++b)
+        {
+            std::vector<uint32_t> selected;
+            for(const auto& bundle_tracts : bundle_tracts_threads)
+                if(!bundle_tracts.empty())
+                    selected.insert(selected.end(),bundle_tracts[b].begin(),bundle_tracts[b].end());
+            if(selected.empty())
+                continue;
+            std::sort(selected.begin(),selected.end());
+            std::vector<std::vector<float> > new_tracts;
+            for(auto i : selected)
+                new_tracts.push_back(tracts[i]);
+
+            auto tract_model = std::make_shared<TractModel>(handle);
+            tract_model->add_tracts(new_tracts);
+            tract_model->trim(thread.param.tip_iteration);
+            // if trim removes too many tract, undo to at least get the smallest possible bundle.
+            if(thread.param.tip_iteration && tract_model->get_visible_track_count() == 0)
+                tract_model->undo();
+            if(tract_model->get_visible_track_count() == 0)
+                continue;
+            if(thread.param.step_size != 0.0f)
+                tract_model->resample(1.0f);
+            tract_model->delete_repeated(1.0f);
+            tract_models[b] = tract_model;
+        }
+
+        for(size_t b = 0;b < bundles.size();++b)
+        {
+            if(!tract_models[b])
+            {
+                tipl::out() << "no result for " << names[b] << " from single-pass tracking" << std::endl;
+                continue;
+            }
+            auto tract_model = tract_models[b];
+            auto_track_files files(dir,fib_file_name,names[b],trk_format,stat_format);
+            if(export_trk)
+            {
+                tract_model->report = report;
+                if(!tract_model->save_tracts_to_file(files.trk.c_str()))
+                    return std::string("fail to save ")+files.trk;
+                if(export_template_trk &&
+                   !tract_model->save_tracts_in_template_space(handle,files.template_trk.c_str()))
+                        return std::string("fail to save ")+files.template_trk;
+            }
+            if(po.has("connectivity") && !get_connectivity_matrix(po,handle,files.trk,tract_model))
+                return std::string("fail to output connectivity matrix");
+            if(export_stat &&
+               (overwrite || !std::filesystem::exists(files.stat) || !std::filesystem::file_size(files.stat)))
+            {
+                tipl::out() << "saving " << files.stat;
+                std::ofstream out_stat(files.stat.c_str());
+                std::string result;
+                tract_model->get_quantitative_info(handle,result);
+                out_stat << result;
+            }
+            tracked[bundles[b]] = 1;
+        }
+        return std::string();
+    };
+
     std::vector<std::string> scan_names;
     tipl::progress prog0("automatic fiber tracking");
     for(size_t i = 0;prog0(i,file_list.size());++i)
@@ -212,11 +432,54 @@ std::string run_auto_track(tipl::program_option<tipl::out>& po,const std::vector
         tipl::out() << "processing " << cur_file_base_name << std::endl;
         std::shared_ptr<fib_data> handle;
 
+        std::vector<char> tracked(tract_name_list.size());
+        if(single_pass)
+        {
+            // bundles that need new tracking results
+            std::vector<size_t> bundles;
+            for(size_t j = 0;j < tract_name_list.size();++j)
+            {
+                auto_track_files files(dir,fib_file_name,tract_name_list[j],trk_format,stat_format);
+                bool has_stat_file = std::filesystem::exists(files.stat);
+                bool has_trk_file = std::filesystem::exists(files.trk) &&
+                        (!export_template_trk || std::filesystem::exists(files.template_trk));
+                // existing results are handled by the per-bundle loop
+                if(!overwrite && (std::filesystem::exists(files.no_result) || has_trk_file ||
+                                  ((!export_stat || has_stat_file) && !export_trk)))
+                    continue;
+                bundles.push_back(j);
+            }
+            if(bundles.size() > 1)
+            {
+                // hold the output files while tracking, as the per-bundle tracking does
+                std::vector<std::shared_ptr<file_holder> > holders;
+                for(auto j : bundles)
+                {
+                    auto_track_files files(dir,fib_file_name,tract_name_list[j],trk_format,stat_format);
+                    QDir output_dir(files.output_path.c_str());
+                    if (!output_dir.exists() && !output_dir.mkpath("."))
+                        tipl::out() << std::string("cannot create directory: ") + files.output_path << std::endl;
+                    if(export_stat && !std::filesystem::exists(files.stat))
+                        holders.push_back(std::make_shared<file_holder>(files.stat));
+                    if(export_trk && !std::filesystem::exists(files.trk))
+                        holders.push_back(std::make_shared<file_holder>(files.trk));
+                }
+                handle = std::make_shared<fib_data>();
+                if(!handle->load_from_file(fib_file_name.c_str()))
+                   return handle->error_msg;
+                set_template(handle,po);
+                auto error = track_bundles_at_once(handle,fib_file_name,bundles,tracked);
+                if(!error.empty())
+                    return error;
+            }
+        }
+
         tipl::progress prog1("tracking pathways");
         for(size_t j = 0;prog1(j,tract_name_list.size());++j)
         {
             std::string tract_name = tract_name_list[j];
-            std::string output_path = dir + "/" + tract_name;
+            auto_track_files files(dir,fib_file_name,tract_name,trk_format,stat_format);
+            const std::string& output_path = files.output_path;
             tipl::out() << "tracking " << tract_name;
 
             // create storing directory
@@ -225,13 +488,16 @@ std::string run_auto_track(tipl::program_option<tipl::out>& po,const std::vector
                 if (!dir.exists() && !dir.mkpath("."))
                     tipl::out() << std::string("cannot create directory: ") + output_path << std::endl;
             }
-            std::string fib_base = QFileInfo(fib_file_name.c_str()).baseName().toStdString();
-            std::string no_result_file_name = output_path + "/" + fib_base+"."+tract_name+".no_result.txt";
-            std::string trk_file_name = output_path + "/" + fib_base+"."+tract_name+ "." + trk_format;
-            std::string template_trk_file_name = output_path + "/T_" + fib_base+"."+tract_name + "." + trk_format;
-            std::string stat_file_name = output_path + "/" + fib_base+"."+tract_name+"." + stat_format;
-            std::string report_file_name = dir+"/"+tract_name+".report.txt";
+            const std::string& no_result_file_name = files.no_result;
+            const std::string& trk_file_name = files.trk;
+            const std::string& template_trk_file_name = files.template_trk;
+            const std::string& stat_file_name = files.stat;
             stat_files[j].push_back(stat_file_name);
+            if(tracked[j])
+            {
+                tipl::out() << tract_name << " obtained from single-pass tracking" << std::endl;
+                continue;
+            }
             if(std::filesystem::exists(no_result_file_name) && !overwrite)
             {
                 tipl::out() << "skip " << tract_name << " due to no result" << std::endl;
@@ -310,42 +576,7 @@ std::string run_auto_track(tipl::program_option<tipl::out>& po,const std::vector
                     std::string report = handle->report;
                     report += thread.report.str();
                     auto_track_report = report;
-                    bool no_result = false;
-                    {
-                        while(!thread.is_ended() && !prog2.aborted())
-                        {
-                            std::this_thread::yield();
-                            if(!thread.param.termination_count)
-                            {
-                                prog2(0,1);
-                                continue;
-                            }
-                            prog2(thread.get_total_tract_count(),thread.param.termination_count);
-                            // terminate if yield rate is very low, likely quality problem
-                            if(thread.get_total_seed_count() > yield_check_count &&
-                               thread.get_total_tract_count() < float(thread.get_total_seed_count())*yield_rate)
-                            {
-                                tipl::out() << "low yield rate (" << thread.get_total_tract_count() << "/" <<
-                                                    thread.get_total_seed_count() << "), terminating" << std::endl;
-                                no_result = true;
-                                thread.end_thread();
-                                break;
-                            }
-                        }
-
-                        float sec = float(std::chrono::duration_cast<std::chrono::milliseconds>(
-                                    thread.end_time-thread.begin_time).count())*0.001f;
-                        if(thread.get_total_seed_count())
-                        {
-                            tipl::out() << "yield rate (tract generated per seed): " <<
-                                    float(thread.get_total_tract_count())/float(thread.get_total_seed_count()) << std::endl;
-                            tipl::out() << "tract yield rate (tracts per second): " <<
-                                                       float(thread.get_total_tract_count())/sec << std::endl;
-                            tipl::out() << "seed yield rate (seeds per second): " <<
-                                                       float(thread.get_total_seed_count())/sec << std::endl;
-                        }
-
-                    }
+                    bool no_result = !wait_for_tracking(thread,prog2,yield_check_count,yield_rate);
                     if(prog2.aborted())
                         return std::string("aborted.");
                     // fetch both front and back buffer
@@ -70,7 +70,8 @@ bool load_nii(tipl::program_option<tipl::out>& po,
 int trk_post(tipl::program_option<tipl::out>& po,std::shared_ptr<fib_data> handle,std::shared_ptr<TractModel> tract_model,std::string tract_file_name,bool output_track);
 std::shared_ptr<fib_data> cmd_load_fib(tipl::program_option<tipl::out>& po);
 
-bool load_tracts(const char* file_name,std::shared_ptr<fib_data> handle,std::shared_ptr<TractModel> tract_model,std::shared_ptr<RoiMgr> roi_mgr)
+bool load_tracts(const char* file_name,std::shared_ptr<fib_data> handle,std::shared_ptr<TractModel> tract_model,std::shared_ptr<RoiMgr> roi_mgr,
+                 size_t from = 0,size_t to = SIZE_MAX)
 {
     if(!std::filesystem::exists(file_name))
     {
@@ -80,7 +81,7 @@ bool load_tracts(const char* file_name,std::shared_ptr<fib_data> handle,std::sha
     if(QFileInfo(file_name).baseName().contains(".mni."))
         tipl::out() << QFileInfo(file_name).baseName().toStdString() <<
                      " has '.mni.' in the file name. It will be treated as mni-space tracts" << std::endl;
-    if(!tract_model->load_tracts_from_file(file_name,handle.get(),QFileInfo(file_name).baseName().contains(".mni.")))
+    if(!tract_model->load_tracts_from_file(file_name,handle.get(),QFileInfo(file_name).baseName().contains(".mni."),from,to))
     {
         tipl::error() << "cannot read or parse " << file_name << std::endl;
         return false;
@@ -194,11 +195,25 @@ int ana_tract(tipl::program_option<tipl::out>& po,std::shared_ptr<fib_data> hand
     }
 
 
+    // --tract_range=from,to loads only tracts [from,to) of each file
+    size_t tract_from = 0,tract_to = SIZE_MAX;
+    if(po.has("tract_range"))
+    {
+        std::istringstream in(po.get("tract_range"));
+        char sep = 0;
+        if(!(in >> tract_from >> sep >> tract_to) || sep != ',' || tract_from >= tract_to)
+        {
+            tipl::error() << "invalid --tract_range, specify it as --tract_range=from,to" << std::endl;
+            return 1;
+        }
+        tipl::out() << "loading tracts " << tract_from << " to " << tract_to << std::endl;
+    }
+
     std::vector<std::shared_ptr<TractModel> > tracts;
     for(const auto& each : tract_files)
     {
         tracts.push_back(std::make_shared<TractModel>(handle));
-        if(!load_tracts(each.c_str(),handle,tracts.back(),roi_mgr))
+        if(!load_tracts(each.c_str(),handle,tracts.back(),roi_mgr,tract_from,tract_to))
             return 1;
     }
     tipl::out() << "a total of " << tract_files.size() << " tract file(s) loaded" << std::endl;
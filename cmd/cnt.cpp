@@ -98,6 +98,7 @@ int cnt(tipl::program_option<tipl::out>& po)
     {
         tipl::progress prog("connectometry parameters");
         vbc->no_tractogram = (po.get("no_tractogram",1) == 1);
+        vbc->parallel_permutation = (po.get("parallel_permutation",0) == 1);
         vbc->foi_str = foi_str;
         vbc->length_threshold_voxels = po.get("length_threshold",(vbc->handle->dim[0]/4)/5*5);
         vbc->tip_iteration = po.get("tip_iteration",16);
@@ -34,6 +34,11 @@ int rec(tipl::program_option<tipl::out>& po)
         src.voxel.other_output = po.get("other_output","fa,rd,iso,rdi");
         src.voxel.r2_weighted = po.get("r2_weighted",int(0));
         src.voxel.thread_count = tipl::max_thread_count = po.get("thread_count",tipl::max_thread_count);
+        src.voxel.block_size = po.get("block_size",src.voxel.block_size);
+        src.voxel.morton_order = po.get("morton_order",int(0));
+        src.voxel.voxel_major = po.get("voxel_major",int(0));
+        src.voxel.odf_memory_budget = po.get("odf_memory_budget",int(0));
+        src.voxel.qsdr_kernel_error = po.get("qsdr_kernel_error",src.voxel.qsdr_kernel_error);
         src.voxel.param[0] = po.get("param0",src.voxel.param[0]);
         src.voxel.param[1] = po.get("param1",src.voxel.param[1]);
         src.voxel.param[2] = po.get("param2",src.voxel.param[2]);
@@ -43,7 +43,7 @@ bool group_connectometry_analysis::load_database(const char* database_name)
 
 
 int group_connectometry_analysis::run_track(std::shared_ptr<tracking_data> fib,
-                                            std::vector<std::vector<float> >& tracks,
+                                            std::vector<tract_arena>& tracks,
                                             unsigned int seed_count,
                                             unsigned int random_seed,
                                             unsigned int thread_count)
@@ -60,11 +60,15 @@ int group_connectometry_analysis::run_track(std::shared_ptr<tracking_data> fib,
     tracking_thread.param.termination_count = uint32_t(seed_count);
     tracking_thread.roi_mgr = roi_mgr;
     tracking_thread.run(fib,thread_count,true);
+    // take over the thread arenas without copying the tracts
+    size_t count = 0;
     for(auto& tracts_per_thread : tracking_thread.track_buffer_front)
-        for(auto& tract : tracts_per_thread)
-            if(!tract.empty())
-                tracks.push_back(std::move(tract));
-    return int(tracks.size());
+        if(!tracts_per_thread.empty())
+        {
+            count += tracts_per_thread.size();
+            tracks.push_back(std::move(tracts_per_thread));
+        }
+    return int(count);
 }
 
 void cal_hist(const std::vector<std::vector<float> >& track,std::vector<unsigned int>& dist)
@@ -81,6 +85,21 @@ void cal_hist(const std::vector<std::vector<float> >& track,std::vector<unsigned
                 ++dist.back();
     }
 }
+void cal_hist(const std::vector<tract_arena>& tracks,std::vector<unsigned int>& dist)
+{
+    for(const auto& track : tracks)
+        for(size_t j = 0; j < track.size();++j)
+        {
+            if(track.tract_size(j) <= 3)
+                continue;
+            unsigned int length = track.tract_size(j)/3-1;
+            if(length < dist.size())
+                ++dist[length];
+            else
+                if(!dist.empty())
+                    ++dist.back();
+        }
+}
 
 void group_connectometry_analysis::exclude_cerebellum(void)
 {
@@ -94,6 +113,53 @@ void group_connectometry_analysis::exclude_cerebellum(void)
     }
 }
 
+void group_connectometry_analysis::run_permutation_once(std::shared_ptr<tracking_data> fib,connectometry_result& data,
+                                                        unsigned int i,bool null,unsigned int thread_count)
+{
+    std::vector<tract_arena> pos_tracks,neg_tracks;
+
+    stat_model info;
+
+    // one spm pass gives both the inc and dec maps of this permutation
+    info.resample(*model.get(),null,true,i);
+    calculate_spm(data,info,thread_count);
+    if(terminated)
+        return;
+    fib->dt_fa = data.dec_ptr;
+
+    run_track(fib,neg_tracks,seed_count,i,thread_count);
+    cal_hist(neg_tracks,(null) ? tract_count_dec_null : tract_count_dec);
+
+    fib->dt_fa = data.inc_ptr;
+
+    run_track(fib,pos_tracks,seed_count,i,thread_count);
+    cal_hist(pos_tracks,(null) ? tract_count_inc_null : tract_count_inc);
+
+    {
+        std::lock_guard<std::mutex> lock(lock_add_tracks);
+        auto& neg_track = null ? neg_null_corr_track : dec_track;
+        auto& pos_track = null ? pos_null_corr_track : inc_track;
+        for(const auto& each : neg_tracks)
+            neg_track->add_tracts(each,length_threshold_voxels,tipl::rgb(0x004040F0));
+        for(const auto& each : pos_tracks)
+            pos_track->add_tracts(each,length_threshold_voxels,tipl::rgb(0x00F04040));
+    }
+}
+// permutations run one at a time with all threads working on each of them,
+// so that only one set of inc/dec maps and one tracking_data are in memory
+void group_connectometry_analysis::run_permutation_parallel(unsigned int thread_count,unsigned int permutation_count)
+{
+    connectometry_result data;
+    for(unsigned int i = 0;i < permutation_count && !terminated;++i)
+    {
+        run_permutation_once(shared_fib,data,i,true,thread_count);
+        run_permutation_once(shared_fib,data,i,false,thread_count);
+        ++preprocess;
+        prog = uint32_t((i+1)*95/permutation_count);
+    }
+    if(!terminated)
+        prog = 100;
+}
 void group_connectometry_analysis::run_permutation_multithread(unsigned int id,unsigned int thread_count,unsigned int permutation_count)
 {
     connectometry_result data;
@@ -102,39 +168,7 @@ void group_connectometry_analysis::run_permutation_multithread(unsigned int id,u
     bool null = true;
     for(unsigned int i = id;i < permutation_count && !terminated;)
     {
-        std::vector<std::vector<float> > pos_tracks,neg_tracks;
-
-        stat_model info;
-
-        info.resample(*model.get(),null,true,i);
-        calculate_spm(data,info);
-        fib->dt_fa = data.dec_ptr;
-
-        run_track(fib,neg_tracks,seed_count,i);
-        cal_hist(neg_tracks,(null) ? tract_count_dec_null : tract_count_dec);
-
-
-        info.resample(*model.get(),null,true,i);
-        calculate_spm(data,info);
-        fib->dt_fa = data.inc_ptr;
-
-        run_track(fib,pos_tracks,seed_count,i);
-        cal_hist(pos_tracks,(null) ? tract_count_inc_null : tract_count_inc);
-
-        {
-            std::lock_guard<std::mutex> lock(lock_add_tracks);
-            if(null)
-            {
-                neg_null_corr_track->add_tracts(neg_tracks,length_threshold_voxels,tipl::rgb(0x004040F0));
-                pos_null_corr_track->add_tracts(pos_tracks,length_threshold_voxels,tipl::rgb(0x00F04040));
-            }
-            else
-            {
-                dec_track->add_tracts(neg_tracks,length_threshold_voxels,tipl::rgb(0x004040F0));
-                inc_track->add_tracts(pos_tracks,length_threshold_voxels,tipl::rgb(0x00F04040));
-            }
-        }
-
+        run_permutation_once(fib,data,i,null,1);
         if(!null)
         {
             ++preprocess;
@@ -330,8 +364,16 @@ void group_connectometry_analysis::calculate_adjusted_qa(stat_model& info)
     }
 
     // population_value_adjusted is a transpose of handle->db.subject_qa
-    population_value_adjusted.clear();
-    population_value_adjusted.resize(handle->db.subject_qa_length);
+    population_size = info.selected_subject.size();
+    handle->db.get_voxel_major(info.selected_subject,population_value_adjusted);
+    population_rank.clear();
+    if(!population_size)
+        return;
+    info.partial_correlation(population_value_adjusted.data(),handle->db.subject_qa_length);
+    // pre-rank each population for the nonparametric correlation
+    if(!info.study_feature || population_size >= 65535)
+        return;
+    population_rank.resize(population_value_adjusted.size());
     const auto& si2vi = handle->mat_reader.si2vi;
     tipl::par_for(si2vi.size(),[&](size_t s_index)
     {
@@ -339,46 +381,48 @@ void group_connectometry_analysis::calculate_adjusted_qa(stat_model& info)
         for(size_t fib = 0;s_index < handle->db.subject_qa_length &&
                            handle->dir.fa[fib][pos] > fiber_threshold;++fib,s_index += si2vi.size())
         {
-            std::vector<float> population(info.selected_subject.size());
-            for(unsigned int index = 0;index < info.selected_subject.size();++index)
-                population[index] = handle->db.subject_qa[info.selected_subject[index]][s_index];
-
-            if(!population.empty())
-            {
-                info.partial_correlation(population);
-                population_value_adjusted[s_index] = std::move(population);
-            }
+            const float* population = population_value_adjusted.data()+s_index*population_size;
+            auto rank = tipl::rank(std::vector<float>(population,population+population_size),std::less<float>());
+            std::copy(rank.begin(),rank.end(),population_rank.begin()+s_index*population_size);
         }
     });
 }
 
-void group_connectometry_analysis::calculate_spm(connectometry_result& data,stat_model& info)
+void group_connectometry_analysis::calculate_spm(connectometry_result& data,stat_model& info,unsigned int thread_count)
 {
     data.clear_result(handle->dir.num_fiber,handle->dim.size());
     const auto& si2vi = handle->mat_reader.si2vi;
-    for(size_t s_index = 0;s_index < si2vi.size() && !terminated;++s_index)
+    // voxels are processed in chunks, each writing only its own voxels in the maps
+    const size_t chunk_size = 4096;
+    tipl::par_for((si2vi.size()+chunk_size-1)/chunk_size,[&](size_t chunk)
     {
-        size_t pos = si2vi[s_index];
-        double T_stat(0.0); // declare here so that the T-stat of the 1st fiber can be applied to others if there is only one metric per voxel
-        for(size_t fib = 0,cur_s_index = s_index;
-            fib < handle->dir.num_fiber && handle->dir.fa[fib][pos] > fiber_threshold;
-            ++fib,cur_s_index += si2vi.size())
+        stat_buffer buffer;
+        for(size_t s_index = chunk*chunk_size;s_index < std::min<size_t>(si2vi.size(),chunk*chunk_size+chunk_size) && !terminated;++s_index)
         {
-            // some connectometry database only have 1 metrics per voxel
-            // and thus the computed statistics will be applied to all fibers
-            if(cur_s_index < population_value_adjusted.size())
+            size_t pos = si2vi[s_index];
+            double T_stat(0.0); // declare here so that the T-stat of the 1st fiber can be applied to others if there is only one metric per voxel
+            for(size_t fib = 0,cur_s_index = s_index;
+                fib < handle->dir.num_fiber && handle->dir.fa[fib][pos] > fiber_threshold;
+                ++fib,cur_s_index += si2vi.size())
             {
-                if(population_value_adjusted[cur_s_index][0] == 0.0f)
-                    continue;
-                T_stat = info(population_value_adjusted[cur_s_index]);
-            }
+                // some connectometry database only have 1 metrics per voxel
+                // and thus the computed statistics will be applied to all fibers
+                if(cur_s_index < handle->db.subject_qa_length)
+                {
+                    const float* population = population_value_adjusted.data()+cur_s_index*population_size;
+                    if(population[0] == 0.0f)
+                        continue;
+                    T_stat = info(population,population_rank.empty() ? nullptr :
+                                  population_rank.data()+cur_s_index*population_size,buffer);
+                }
 
-            if(T_stat > 0.0)
-                data.inc[fib][pos] = T_stat;
-            if(T_stat < 0.0)
-                data.dec[fib][pos] = -T_stat;
+                if(T_stat > 0.0)
+                    data.inc[fib][pos] = T_stat;
+                if(T_stat < 0.0)
+                    data.dec[fib][pos] = -T_stat;
+            }
         }
-    }
+    },thread_count);
 }
 
 void group_connectometry_analysis::run_permutation(unsigned int thread_count,unsigned int permutation_count)
@@ -522,15 +566,16 @@ void group_connectometry_analysis::run_permutation(unsigned int thread_count,uns
     prog = 0;
     // preliminary run
     {
-        std::shared_ptr<tracking_data> fib(new tracking_data);
-        fib->read(handle);
+        shared_fib = std::make_shared<tracking_data>();
+        shared_fib->read(handle);
+        auto fib = shared_fib;
 
         calculate_adjusted_qa(*model.get());
 
         stat_model info;
         info.resample(*model.get(),false,false,0);
         tipl::out() << "preliminary run to determine seed count" << std::endl;
-        calculate_spm(*spm_map.get(),info);
+        calculate_spm(*spm_map.get(),info,tipl::max_thread_count);
         preprocess = 0;
         seed_count = 1000;
 
@@ -538,18 +583,24 @@ void group_connectometry_analysis::run_permutation(unsigned int thread_count,uns
         auto expected_tract_per_permutation = expected_tract_count/permutation_count;
         while(seed_count < 128000)
         {
-            std::vector<std::vector<float> > tracks;
+            std::vector<tract_arena> tracks;
             fib->dt_fa = spm_map->dec_ptr;
-            run_track(fib,tracks,seed_count,0,tipl::max_thread_count);
+            size_t tract_count = size_t(run_track(fib,tracks,seed_count,0,tipl::max_thread_count));
             fib->dt_fa = spm_map->inc_ptr;
-            run_track(fib,tracks,seed_count,0,tipl::max_thread_count);
-            if(tracks.size() > expected_tract_per_permutation)
+            tract_count += size_t(run_track(fib,tracks,seed_count,0,tipl::max_thread_count));
+            if(tract_count > expected_tract_per_permutation)
                 break;
             seed_count *= 2;
         }
         tipl::out() << "seed count: " << seed_count << std::endl;
     }
 
+    if(parallel_permutation)
+    {
+        tipl::out() << "permutations run one at a time using " << thread_count << " threads" << std::endl;
+        threads.push_back(std::thread([=](){run_permutation_parallel(thread_count,permutation_count);}));
+        return;
+    }
     for(unsigned int index = 0;index < thread_count;++index)
         threads.push_back(std::thread([=](){run_permutation_multithread(index,thread_count,permutation_count);}));
 }
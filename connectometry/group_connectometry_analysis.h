@@ -28,9 +28,9 @@ public:// database information
     float fiber_threshold;
 public:
     void calculate_adjusted_qa(stat_model& info);
-    void calculate_spm(connectometry_result& data,stat_model& info);
+    void calculate_spm(connectometry_result& data,stat_model& info,unsigned int thread_count = 1);
 private: // single subject analysis result
-    int run_track(std::shared_ptr<tracking_data> fib,std::vector<std::vector<float> >& track,
+    int run_track(std::shared_ptr<tracking_data> fib,std::vector<tract_arena>& track,
                   unsigned int seed_count,unsigned int random_seed,unsigned int thread_count = 1);
 public:// for FDR analysis
     std::vector<std::thread> threads;
@@ -42,6 +42,7 @@ public:// for FDR analysis
     unsigned int prog;// 0~100
     bool terminated = false;
     bool no_tractogram = false;
+    bool parallel_permutation = false; // run permutations one at a time, each using all threads
     unsigned int preprocess = 0;
 public:
     std::shared_ptr<RoiMgr> roi_mgr;
@@ -54,7 +55,11 @@ public:
 public:// Multiple regression
     std::shared_ptr<stat_model> model;
     std::shared_ptr<connectometry_result> spm_map;
-    std::vector<std::vector<float> > population_value_adjusted;
+    std::shared_ptr<tracking_data> shared_fib;
+    // fiber-voxel-major values, each s_index holds population_size subjects contiguously
+    std::vector<float> population_value_adjusted;
+    size_t population_size = 0;
+    std::vector<uint16_t> population_rank;
     std::string index_name,hypothesis_inc,hypothesis_dec;
     float t_threshold;
     unsigned int length_threshold_voxels;
@@ -62,6 +67,9 @@ public:// Multiple regression
     unsigned int tip_iteration;
     std::string foi_str;
     std::string get_file_post_fix(void);
+    void run_permutation_once(std::shared_ptr<tracking_data> fib,connectometry_result& data,
+                              unsigned int i,bool null,unsigned int thread_count);
+    void run_permutation_parallel(unsigned int thread_count,unsigned int permutation_count);
     void run_permutation_multithread(unsigned int id,unsigned int thread_count,unsigned int permutation_count);
     void run_permutation(unsigned int thread_count,unsigned int permutation_count);
     void calculate_FDR(void);
@@ -1,6 +1,13 @@
+#include <atomic>
 #include "basic_voxel.hpp"
 #include "image_model.hpp"
 
+void BaseProcess::run_block(Voxel& voxel,VoxelBlock& block)
+{
+    for(auto& data : block)
+        run(voxel,data);
+}
+
 bool Voxel::init(void)
 {
     tipl::progress prog("pre-reconstruction",true);
@@ -12,16 +19,30 @@ bool Voxel::init(void)
     }
     else
     {
+        auto init_data = [this](VoxelData& data)
+        {
+            data.space.resize(bvalues.size());
+            data.odf.resize(ti.half_vertices_count);
+            data.fa.resize(max_fiber_number);
+            data.dir_index.resize(max_fiber_number);
+            data.dir.resize(max_fiber_number);
+        };
         voxel_data.resize(thread_count);
         for (unsigned int index = 0; index < thread_count; ++index)
+            init_data(voxel_data[index]);
+        voxel_block.clear();
+        if(block_size > 1)
         {
-            voxel_data[index].space.resize(bvalues.size());
-            voxel_data[index].odf.resize(ti.half_vertices_count);
-            voxel_data[index].fa.resize(max_fiber_number);
-            voxel_data[index].dir_index.resize(max_fiber_number);
-            voxel_data[index].dir.resize(max_fiber_number);
+            voxel_block.resize(thread_count);
+            for (unsigned int index = 0; index < thread_count; ++index)
+            {
+                voxel_block[index].data.resize(block_size);
+                for(auto& data : voxel_block[index].data)
+                    init_data(data);
+            }
         }
     }
+    band_size = 0;
     for (unsigned int index = 0; prog(index,process_list.size()); ++index)
     {
         tipl::out() << process_name[index];
@@ -126,25 +147,137 @@ bool Voxel::run_hist(void)
     });
     return !prog.aborted();
 }
-bool Voxel::run(const char* title)
+std::vector<size_t> Voxel::get_voxel_list(void) const
+{
+    std::vector<size_t> voxel_list;
+    for(size_t index = 0;index < mask.size();++index)
+        if(mask[index])
+            voxel_list.push_back(index);
+    if(morton_order)
+    {
+        auto spread = [](uint64_t v)
+        {
+            v &= 0x1fffff;
+            v = (v | v << 32) & 0x1f00000000ffffull;
+            v = (v | v << 16) & 0x1f0000ff0000ffull;
+            v = (v | v << 8) & 0x100f00f00f00f00full;
+            v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+            v = (v | v << 2) & 0x1249249249249249ull;
+            return v;
+        };
+        std::vector<uint64_t> key(voxel_list.size());
+        tipl::adaptive_par_for(voxel_list.size(),[&](size_t i)
+        {
+            tipl::pixel_index<3> pos(voxel_list[i],dim);
+            key[i] = spread(uint64_t(pos.x())) | (spread(uint64_t(pos.y())) << 1) | (spread(uint64_t(pos.z())) << 2);
+        });
+        // sort within each band so that bands still cover consecutive masked voxels
+        size_t band = band_size ? band_size : voxel_list.size();
+        for(size_t from = 0;from < voxel_list.size();from += band)
+        {
+            size_t to = std::min<size_t>(voxel_list.size(),from+band);
+            std::vector<uint64_t> band_key(key.begin()+int64_t(from),key.begin()+int64_t(to));
+            std::vector<size_t> band_list(voxel_list.begin()+int64_t(from),voxel_list.begin()+int64_t(to));
+            auto order = tipl::arg_sort(band_key,std::less<uint64_t>());
+            for(size_t i = 0;i < order.size();++i)
+                voxel_list[from+i] = band_list[order[i]];
+        }
+    }
+    return voxel_list;
+}
+
+namespace{
+struct alignas(64) chunk_queue{
+    std::atomic<size_t> next{0};
+    size_t to = 0;
+    std::atomic<size_t> done{0};
+};
+}
+// Each thread first takes chunks from its own contiguous range and then steals
+// from the ranges of other threads. Progress is kept per thread and summed only
+// when reported.
+template<typename fun_type>
+bool run_chunks(const char* title,size_t chunk_count,unsigned int thread_count,fun_type&& fun)
 {
     tipl::progress prog(title,true);
-    size_t total_size = 0;
+    std::vector<chunk_queue> queue(thread_count);
+    for(size_t i = 0;i < thread_count;++i)
+    {
+        queue[i].next = chunk_count*i/thread_count;
+        queue[i].to = chunk_count*(i+1)/thread_count;
+    }
     tipl::par_for(thread_count,[&](size_t thread_id)
     {
-        for(size_t voxel_index = thread_id;voxel_index < mask.size() && prog(total_size++,mask.size());voxel_index += thread_count)
+        for(size_t k = 0;k < thread_count;++k)
         {
-            if(!mask[voxel_index])
-                continue;
-            voxel_data[thread_id].init();
-            voxel_data[thread_id].voxel_index = voxel_index;
-            for (size_t index = 0; index < process_list.size(); ++index)
-                process_list[index]->run(*this,voxel_data[thread_id]);
+            auto& q = queue[(thread_id+k)%thread_count];
+            while(1)
+            {
+                size_t chunk = q.next.fetch_add(1,std::memory_order_relaxed);
+                if(chunk >= q.to)
+                    break;
+                size_t total_done = 0;
+                for(const auto& each : queue)
+                    total_done += each.done.load(std::memory_order_relaxed);
+                if(!prog(total_done,chunk_count))
+                    return;
+                fun(thread_id,chunk);
+                queue[thread_id].done.fetch_add(1,std::memory_order_relaxed);
+            }
         }
     },thread_count);
     return !prog.aborted();
 }
 
+bool Voxel::run(const char* title)
+{
+    auto voxel_list = get_voxel_list();
+    if(!band_size || band_size >= voxel_list.size())
+        return run_band(title,voxel_list,0,voxel_list.size());
+    tipl::progress prog(title,true);
+    size_t band_count = (voxel_list.size()+band_size-1)/band_size;
+    for(size_t band = 0;prog(band,band_count);++band)
+    {
+        size_t from = band*band_size;
+        size_t to = std::min<size_t>(voxel_list.size(),from+band_size);
+        if(!run_band("reconstructing band",voxel_list,from,to))
+            return false;
+        for (size_t index = 0; index < process_list.size(); ++index)
+            process_list[index]->end_band(*this,from,to);
+    }
+    return !prog.aborted();
+}
+
+bool Voxel::run_band(const char* title,const std::vector<size_t>& voxel_list,size_t from,size_t to)
+{
+    if(block_size > 1 && !voxel_block.empty())
+        return run_chunks(title,(to-from+block_size-1)/block_size,thread_count,[&](size_t thread_id,size_t chunk)
+        {
+            auto& block = voxel_block[thread_id];
+            size_t pos = from+chunk*block_size;
+            block.size = std::min<size_t>(block_size,to-pos);
+            for(size_t i = 0;i < block.size;++i)
+            {
+                block[i].init();
+                block[i].voxel_index = voxel_list[pos+i];
+            }
+            for (size_t index = 0; index < process_list.size(); ++index)
+                process_list[index]->run_block(*this,block);
+        });
+    const size_t chunk_size = 64;
+    return run_chunks(title,(to-from+chunk_size-1)/chunk_size,thread_count,[&](size_t thread_id,size_t chunk)
+    {
+        auto& data = voxel_data[thread_id];
+        size_t chunk_end = std::min<size_t>(to,from+(chunk+1)*chunk_size);
+        for(size_t pos = from+chunk*chunk_size;pos < chunk_end;++pos)
+        {
+            data.init();
+            data.voxel_index = voxel_list[pos];
+            for (size_t index = 0; index < process_list.size(); ++index)
+                process_list[index]->run(*this,data);
+        }
+    });
+}
 
 bool Voxel::end(tipl::io::gz_mat_write& writer)
 {
@@ -10,6 +10,7 @@ struct src_data;
 struct VoxelParam;
 class Voxel;
 struct VoxelData;
+struct VoxelBlock;
 struct HistData;
 class BaseProcess
 {
@@ -18,6 +19,10 @@ public:
     virtual bool needed(Voxel&) {return true;}
     virtual void init(Voxel&) {}
     virtual void run(Voxel&, VoxelData&) {}
+    // processes a block of voxels at once, falls back to per-voxel run by default
+    virtual void run_block(Voxel& voxel,VoxelBlock& block);
+    // called after each band of masked voxels when Voxel::band_size is set
+    virtual void end_band(Voxel&,size_t,size_t) {}
     virtual void run_hist(Voxel&,HistData&) {}
     virtual void end(Voxel&,tipl::io::gz_mat_write&) {}    
     virtual ~BaseProcess(void) {}
@@ -46,6 +51,21 @@ struct VoxelData
     }
 };
 
+struct VoxelBlock
+{
+    std::vector<VoxelData> data;
+    size_t size = 0; // number of voxels in use
+public:// matrices shared by batched stages (row: q-space or odf, column: voxel)
+    std::vector<float> space,odf;
+    std::vector<size_t> active;
+public:
+    VoxelData& operator[](size_t index){return data[index];}
+    auto begin(void){return data.begin();}
+    auto end(void){return data.begin()+int64_t(size);}
+};
+// C(m,n) = A(m,k)*B(k,n) in row-major order, cache-blocked (gqi_process.cpp)
+void block_product(const float* A,const float* B,float* C,size_t m,size_t k,size_t n);
+
 struct HistData
 {
 public:
@@ -77,12 +97,19 @@ public:
     tipl::image<3,unsigned char> mask;
 public:
     std::vector<const unsigned short*> dwi_data;
+    bool voxel_major = false;
+    std::vector<unsigned short> voxel_major_dwi; // all DWI of a masked voxel stored contiguously
+    std::vector<uint32_t> voxel_major_row;       // voxel index to the row in voxel_major_dwi
     std::vector<tipl::vector<3,float> > bvectors;
     std::vector<float> bvalues;
 
     std::string intro,report,steps;
     std::ostringstream recon_report, step_report;
     unsigned int thread_count = tipl::max_thread_count;
+    unsigned int block_size = 64; // voxels per block, 0 or 1 uses per-voxel processing
+    bool morton_order = false; // process voxels in Z-order instead of raster order
+    size_t band_size = 0;      // masked voxels reconstructed before calling end_band, 0: all at once
+    size_t odf_memory_budget = 0;  // MB for buffering output ODFs (DWI is not included), 0: no limit
     void load_from_src(src_data& image_model);
 public:
     unsigned char method_id;
@@ -131,6 +158,7 @@ public:// used in QSDR
     bool qsdr = false;
     float R2 = 0.9f;
     float qsdr_reso = 1.0f;
+    float qsdr_kernel_error = 0.0f; // max error of the tabulated QSDR kernel, 0: exact evaluation
 public:
     tipl::vector<3> partial_min,partial_max;
 public: // for QSDR associated T1WT2W
@@ -158,6 +186,7 @@ public:// for template creation
     std::string template_file_name;
 public:
     std::vector<VoxelData> voxel_data;
+    std::vector<VoxelBlock> voxel_block;
     std::vector<HistData> hist_data;
 public:
     template<typename T,typename ...Ts>
@@ -187,6 +216,8 @@ public:
 public:
     bool init(void);
     bool run(const char* title);
+    bool run_band(const char* title,const std::vector<size_t>& voxel_list,size_t from,size_t to);
+    std::vector<size_t> get_voxel_list(void) const;
     bool run_hist(void);
     bool end(tipl::io::gz_mat_write& writer);
     BaseProcess* get(unsigned int index);
@@ -30,10 +30,31 @@ void GQI_Recon::calculate_q_vec_t(Voxel& voxel)
         q_vectors_time[index] *= sigma;
     }
 }
+void GQI_Recon::calculate_kernel_table(Voxel& voxel)
+{
+    // both kernels are integrals of r^n*cos(x*r) over [0,1] and |f''(x)| <= 1/3,
+    // so linear interpolation at step h has an error bound of h*h/24
+    kernel_table_step = std::sqrt(24.0f*voxel.qsdr_kernel_error);
+    float max_x = 0.0f;
+    for(const auto& q : q_vectors_time)
+        max_x = std::max<float>(max_x,float(q.length()));
+    kernel_table.resize(size_t(max_x/kernel_table_step)+3);
+    for(size_t i = 0;i < kernel_table.size();++i)
+    {
+        float x = float(i)*kernel_table_step;
+        kernel_table[i] = voxel.r2_weighted ? base_function(x) : sinc_pi_imp(x);
+    }
+    tipl::out() << "QSDR kernel tabulated at " << kernel_table.size() << " points with max error " << voxel.qsdr_kernel_error;
+}
 void GQI_Recon::init(Voxel& voxel)
 {
+    kernel_table.clear();
     if(voxel.qsdr)
+    {
         calculate_q_vec_t(voxel);
+        if(voxel.qsdr_kernel_error > 0.0f)
+            calculate_kernel_table(voxel);
+    }
     else
         calculate_sinc_ql(voxel);
     dsi_half_sphere = voxel.shell.size() > 4 && voxel.shell[1] - voxel.shell[0] <= 3;
@@ -49,6 +70,28 @@ void GQI_Recon::run(Voxel& voxel, VoxelData& data)
     if(dsi_half_sphere)
         data.space[0] *= 0.5f;
     // add rotation from QSDR or gradient nonlinearity
+    if(voxel.qsdr && !kernel_table.empty())
+    {
+        // accumulate the ODF directly from the table without a voxel-specific sinc_ql
+        const float inv_step = 1.0f/kernel_table_step;
+        const float* table = &kernel_table[0];
+        for (unsigned int j = 0; j < data.odf.size(); ++j)
+        {
+            tipl::vector<3,float> from(voxel.ti.vertices[j]);
+            from.rotate(data.jacobian);
+            from.normalize();
+            float sum = 0.0f;
+            for (unsigned int i = 0; i < data.space.size(); ++i)
+            {
+                float x = std::fabs(q_vectors_time[i]*from)*inv_step;
+                auto k = uint32_t(x);
+                float w = x-float(k);
+                sum += (table[k]+w*(table[k+1]-table[k]))*data.space[i];
+            }
+            data.odf[j] = sum;
+        }
+    }
+    else
     if(voxel.qsdr)
     {
         std::vector<float> sinc_ql_(data.odf.size()*data.space.size());
@@ -73,5 +116,82 @@ void GQI_Recon::run(Voxel& voxel, VoxelData& data)
                                 tipl::shape<2>(uint32_t(data.odf.size()),uint32_t(data.space.size())));
 }
 
+// C(m,n) = A(m,k)*B(k,n) in row-major order. The loop is blocked on m and k
+// so that a panel of B stays in cache, and the inner loop runs over
+// contiguous columns of B and C to allow vectorization.
+void block_product(const float* A,const float* B,float* C,size_t m,size_t k,size_t n)
+{
+    const size_t m_block = 32;
+    const size_t k_block = 128;
+    std::fill(C,C+m*n,0.0f);
+    for(size_t k0 = 0;k0 < k;k0 += k_block)
+    {
+        size_t k1 = std::min<size_t>(k,k0+k_block);
+        for(size_t m0 = 0;m0 < m;m0 += m_block)
+        {
+            size_t m1 = std::min<size_t>(m,m0+m_block);
+            for(size_t i = m0;i < m1;++i)
+            {
+                const float* a = A+i*k;
+                float* c = C+i*n;
+                for(size_t p = k0;p < k1;++p)
+                {
+                    const float a_ip = a[p];
+                    const float* b = B+p*n;
+                    for(size_t j = 0;j < n;++j)
+                        c[j] += a_ip*b[j];
+                }
+            }
+        }
+    }
+}
+
+void GQI_Recon::run_block(Voxel& voxel,VoxelBlock& block)
+{
+    // QSDR requires a voxel-specific sinc_ql
+    if(voxel.qsdr)
+    {
+        BaseProcess::run_block(voxel,block);
+        return;
+    }
+    block.active.clear();
+    for(size_t i = 0;i < block.size;++i)
+    {
+        auto& data = block[i];
+        if(data.space.front() == 0.0f)
+        {
+            std::fill(data.odf.begin(),data.odf.end(),0.0f);
+            continue;
+        }
+        if(dsi_half_sphere)
+            data.space[0] *= 0.5f;
+        block.active.push_back(i);
+    }
+    if(block.active.empty())
+        return;
+
+    size_t q_count = voxel.bvalues.size();
+    size_t odf_size = voxel.ti.half_vertices_count;
+    size_t n = block.active.size();
 
+    // gather signals into a q_count-by-n matrix
+    block.space.resize(q_count*n);
+    for(size_t t = 0;t < n;++t)
+    {
+        const auto& space = block[block.active[t]].space;
+        for(size_t q = 0,pos = t;q < q_count;++q,pos += n)
+            block.space[pos] = space[q];
+    }
 
+    // odf_size-by-n ODF matrix
+    block.odf.resize(odf_size*n);
+    block_product(&sinc_ql[0],&block.space[0],&block.odf[0],odf_size,q_count,n);
+
+    // scatter back to each voxel
+    for(size_t t = 0;t < n;++t)
+    {
+        auto& odf = block[block.active[t]].odf;
+        for(size_t j = 0,pos = t;j < odf_size;++j,pos += n)
+            odf[j] = block.odf[pos];
+    }
+}
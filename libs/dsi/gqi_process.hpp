@@ -41,12 +41,17 @@ public:
     std::vector<tipl::vector<3,float> > q_vectors_time;
     std::vector<float> sinc_ql;
     bool dsi_half_sphere = false;
+public:// QSDR kernel tabulated against |q*dir|
+    std::vector<float> kernel_table;
+    float kernel_table_step = 0.0f;
 private:
     void calculate_sinc_ql(Voxel& voxel);
     void calculate_q_vec_t(Voxel& voxel);
+    void calculate_kernel_table(Voxel& voxel);
 public:
     virtual void init(Voxel& voxel) override;
     virtual void run(Voxel& voxel, VoxelData& data) override;
+    virtual void run_block(Voxel& voxel,VoxelBlock& block) override;
 };
 
 class HGQI_Recon  : public BaseProcess
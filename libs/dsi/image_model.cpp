@@ -99,6 +99,36 @@ void src_data::calculate_dwi_sum(bool update_mask)
 }
 
 
+void src_data::get_voxel_major_dwi(std::vector<unsigned short>& buffer,std::vector<uint32_t>& voxel_row) const
+{
+    // rows follow the processing order of Voxel::run
+    auto voxel_list = voxel.get_voxel_list();
+    size_t dwi_count = voxel.dwi_data.size();
+    voxel_row.clear();
+    voxel_row.resize(voxel.dim.size());
+    for(size_t i = 0;i < voxel_list.size();++i)
+        voxel_row[voxel_list[i]] = uint32_t(i);
+    buffer.resize(voxel_list.size()*dwi_count);
+    // transpose in tiles of voxels by DWI volumes
+    const size_t tile = 64;
+    tipl::adaptive_par_for((voxel_list.size()+tile-1)/tile,[&](size_t t)
+    {
+        size_t from = t*tile;
+        size_t to = std::min<size_t>(voxel_list.size(),from+tile);
+        for(size_t d0 = 0;d0 < dwi_count;d0 += tile)
+        {
+            size_t d1 = std::min<size_t>(dwi_count,d0+tile);
+            for(size_t i = from;i < to;++i)
+            {
+                unsigned short* out = &buffer[i*dwi_count];
+                size_t index = voxel_list[i];
+                for(size_t d = d0;d < d1;++d)
+                    out[d] = voxel.dwi_data[d][index];
+            }
+        }
+    });
+}
+
 
 bool src_data::mask_from_template(void)
 {
@@ -218,6 +218,7 @@ void distortion_estimate(const image_type& v1,const image_type& v2,
 
 class DwiHeader;
 class fib_data;
+class ReadDWIData;
 struct src_data
 {
     src_data(void){}
@@ -265,6 +266,7 @@ public:
 public:
     void draw_mask(tipl::color_image& buffer,int position);
     void calculate_dwi_sum(bool update_mask);
+    void get_voxel_major_dwi(std::vector<unsigned short>& buffer,std::vector<uint32_t>& voxel_row) const;
     bool mask_from_unet(void);
     bool mask_from_template(void);
     void remove(unsigned int index);
@@ -346,14 +348,20 @@ public:
             error_msg = "reconstruction canceled";
             return false;
         }
+        if constexpr((std::is_same_v<ProcessList,ReadDWIData> || ...))
+        {
+            if(voxel.voxel_major)
+            {
+                tipl::out() << "creating voxel-major DWI";
+                get_voxel_major_dwi(voxel.voxel_major_dwi,voxel.voxel_major_row);
+            }
+        }
         // reconstruction
-
+        bool result = false;
         try
         {
-            if(voxel.run(prog_title))
-                return true;
-            error_msg = "reconstruction canceled";
-            return false;
+            if(!(result = voxel.run(prog_title)))
+                error_msg = "reconstruction canceled";
         }
         catch(std::exception& error)
         {
@@ -363,7 +371,9 @@ public:
         {
             error_msg = "unknown error";
         }
-        return false;
+        std::vector<unsigned short>().swap(voxel.voxel_major_dwi);
+        std::vector<uint32_t>().swap(voxel.voxel_major_row);
+        return result;
     }
     void check_output_file_name(void);
     bool save_fib(void);
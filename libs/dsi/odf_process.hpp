@@ -1,5 +1,6 @@
 #ifndef ODF_TRANSFORMATION_PROCESS_HPP
 #define ODF_TRANSFORMATION_PROCESS_HPP
+#include <cstdio>
 #include "basic_process.hpp"
 #include "basic_voxel.hpp"
 
@@ -8,9 +9,33 @@ public:
     virtual void run(Voxel& voxel, VoxelData& data)
     {
         data.space.resize(voxel.dwi_data.size());
+        if(!voxel.voxel_major_dwi.empty())
+        {
+            auto row = voxel.voxel_major_dwi.begin() + int64_t(voxel.voxel_major_row[data.voxel_index])*int64_t(data.space.size());
+            std::copy(row,row+int64_t(data.space.size()),data.space.begin());
+            return;
+        }
         for (unsigned int index = 0; index < data.space.size(); ++index)
             data.space[index] = voxel.dwi_data[index][data.voxel_index];
     }
+    virtual void run_block(Voxel& voxel,VoxelBlock& block)
+    {
+        if(!voxel.voxel_major_dwi.empty())
+        {
+            for(auto& data : block)
+                ReadDWIData::run(voxel,data);
+            return;
+        }
+        for(auto& data : block)
+            data.space.resize(voxel.dwi_data.size());
+        // read one DWI volume at a time for all voxels in the block
+        for (unsigned int index = 0; index < voxel.dwi_data.size(); ++index)
+        {
+            const unsigned short* dwi = voxel.dwi_data[index];
+            for(auto& data : block)
+                data.space[index] = dwi[data.voxel_index];
+        }
+    }
 };
 class BalanceScheme : public BaseProcess{
     std::vector<float> trans;
@@ -133,6 +158,20 @@ struct OutputODF : public BaseProcess
 protected:
     std::vector<std::vector<float> > odf_data;
     std::vector<size_t> odf_index_map;
+protected:// ODFs spill to a temporary file when odf_memory_budget is set. they are rewritten to
+          // the fib file at end() because z0 is only known after the last band
+    std::vector<unsigned int> size_list;
+    size_t first_block = 0;
+    std::shared_ptr<FILE> spill;
+    void allocate_band(size_t half_vertices_count)
+    {
+        for (size_t index = 0;index < odf_data.size();++index)
+        {
+            odf_data[index].clear();
+            if(first_block+index < size_list.size())
+                odf_data[index].resize(size_t(size_list[first_block+index])*half_vertices_count);
+        }
+    }
 public:
     virtual bool needed(Voxel& voxel)
     {
@@ -141,6 +180,8 @@ public:
     virtual void init(Voxel& voxel)
     {
         odf_data.clear();
+        spill.reset();
+        first_block = 0;
         {
             voxel.step_report << "[Step T2b(2)][ODFs]=checked" << std::endl;
             size_t total_count = 0;
@@ -153,7 +194,7 @@ public:
                 }
             try
             {
-                std::vector<unsigned int> size_list;
+                size_list.clear();
                 while (1)
                 {
 
@@ -168,14 +209,30 @@ public:
                         break;
                     }
                 }
-                odf_data.resize(size_list.size());
-                for (unsigned int index = 0;index < odf_data.size();++index)
-                    odf_data[index].resize(size_t(size_list[index])*size_t(voxel.ti.half_vertices_count));
+                size_t band_block_count = size_list.size();
+                if(voxel.odf_memory_budget)
+                    band_block_count = std::max<size_t>(1,(voxel.odf_memory_budget << 20)/
+                                       (size_t(odf_block_size)*voxel.ti.half_vertices_count*sizeof(float)));
+                if(band_block_count < size_list.size())
+                {
+                    spill.reset(std::tmpfile(),[](FILE* f){if(f)std::fclose(f);});
+                    if(!spill.get())
+                        throw std::runtime_error("cannot create temporary file for ODF output");
+                    voxel.band_size = band_block_count*odf_block_size;
+                    tipl::out() << "buffering ODFs in bands of " << voxel.band_size << " voxels";
+                }
+                odf_data.resize(std::min<size_t>(band_block_count,size_list.size()));
+                allocate_band(voxel.ti.half_vertices_count);
+            }
+            catch (const std::runtime_error&)
+            {
+                odf_data.clear();
+                throw;
             }
             catch (...)
             {
                 odf_data.clear();
-                throw std::runtime_error("Memory not enough for creating an ODF containing fib file.");
+                throw std::runtime_error("Memory not enough for creating an ODF containing fib file. Consider setting --odf_memory_budget.");
             }
         }
 
@@ -186,15 +243,41 @@ public:
         {
             size_t odf_index = odf_index_map[data.voxel_index];
             std::copy(data.odf.begin(),data.odf.end(),
-                      odf_data[odf_index/odf_block_size].begin() + (odf_index%odf_block_size)*(voxel.ti.half_vertices_count));
+                      odf_data[odf_index/odf_block_size-first_block].begin() + (odf_index%odf_block_size)*(voxel.ti.half_vertices_count));
         }
 
     }
+    virtual void end_band(Voxel& voxel,size_t,size_t)
+    {
+        if(!spill.get())
+            return;
+        for (size_t index = 0;index < odf_data.size() && first_block+index < size_list.size();++index)
+            if(std::fwrite(odf_data[index].data(),sizeof(float),odf_data[index].size(),spill.get()) != odf_data[index].size())
+                throw std::runtime_error("cannot write ODFs to temporary file");
+        first_block += odf_data.size();
+        allocate_band(voxel.ti.half_vertices_count);
+    }
     virtual void end(Voxel& voxel,tipl::io::gz_mat_write& mat_writer)
     {
+        tipl::progress prog("odf",true);
+        if(spill.get())
+        {
+            std::rewind(spill.get());
+            std::vector<float> buffer;
+            for (unsigned int index = 0;prog(index,size_list.size());++index)
+            {
+                buffer.resize(size_t(size_list[index])*voxel.ti.half_vertices_count);
+                if(std::fread(buffer.data(),sizeof(float),buffer.size(),spill.get()) != buffer.size())
+                    throw std::runtime_error("cannot read ODFs from temporary file");
+                tipl::multiply_constant(buffer,voxel.z0);
+                mat_writer.write<tipl::io::sloped>((std::string("odf")+std::to_string(index)).c_str(),buffer,voxel.ti.half_vertices_count);
+            }
+            spill.reset();
+            odf_data.clear();
+            return;
+        }
         for(auto& each : odf_data)
             tipl::multiply_constant(each,voxel.z0);
-        tipl::progress prog("odf",true);
         for (unsigned int index = 0;prog(index,odf_data.size());++index)
             mat_writer.write<tipl::io::sloped>((std::string("odf")+std::to_string(index)).c_str(),odf_data[index],voxel.ti.half_vertices_count);
         odf_data.clear();
@@ -287,12 +370,14 @@ public:
 
 struct SearchLocalMaximum
 {
-    std::vector<std::vector<unsigned short> > neighbor;
+    // neighbors of vertex i are neighbor[neighbor_pos[i]] ... neighbor[neighbor_pos[i+1]-1]
+    std::vector<uint32_t> neighbor_pos;
+    std::vector<unsigned short> neighbor;
     void init(Voxel& voxel)
     {
         unsigned int half_odf_size = voxel.ti.half_vertices_count;
         unsigned int faces_count = uint32_t(voxel.ti.faces.size());
-        neighbor.resize(voxel.ti.half_vertices_count);
+        std::vector<std::vector<unsigned short> > neighbor_list(half_odf_size);
         for (unsigned int index = 0;index < faces_count;++index)
         {
             unsigned short i1 = voxel.ti.faces[index][0];
@@ -304,33 +389,67 @@ struct SearchLocalMaximum
                 i2 -= half_odf_size;
             if (i3 >= half_odf_size)
                 i3 -= half_odf_size;
-            neighbor[i1].push_back(i2);
-            neighbor[i1].push_back(i3);
-            neighbor[i2].push_back(i1);
-            neighbor[i2].push_back(i3);
-            neighbor[i3].push_back(i1);
-            neighbor[i3].push_back(i2);
+            neighbor_list[i1].push_back(i2);
+            neighbor_list[i1].push_back(i3);
+            neighbor_list[i2].push_back(i1);
+            neighbor_list[i2].push_back(i3);
+            neighbor_list[i3].push_back(i1);
+            neighbor_list[i3].push_back(i2);
         }
+        neighbor_pos.resize(half_odf_size+1);
+        neighbor.clear();
+        for (unsigned int index = 0;index < half_odf_size;++index)
+        {
+            auto& nei = neighbor_list[index];
+            std::sort(nei.begin(),nei.end());
+            nei.erase(std::unique(nei.begin(),nei.end()),nei.end());
+            neighbor_pos[index] = uint32_t(neighbor.size());
+            neighbor.insert(neighbor.end(),nei.begin(),nei.end());
+        }
+        neighbor_pos[half_odf_size] = uint32_t(neighbor.size());
     }
-    void search(const std::vector<float>& old_odf,std::map<float,unsigned short,std::greater<float> >& max_table)
+    // find the largest local maxima and store them in descending order
+    // returns the number of peaks stored (at most max_count)
+    unsigned int search(const std::vector<float>& odf,float* peak_value,unsigned short* peak_index,unsigned int max_count) const
     {
-        max_table.clear();
-        for (uint32_t index = 0;index < neighbor.size();++index)
+        unsigned int count = 0;
+        const unsigned short* nei = neighbor.data();
+        for (uint32_t index = 0;index+1 < neighbor_pos.size();++index)
         {
-            float value = old_odf[index];
+            float value = odf[index];
+            if (count == max_count && value < peak_value[count-1])
+                continue;
             bool is_max = true;
-            std::vector<uint16_t>& nei = neighbor[index];
-            for (unsigned int j = 0;j < nei.size();++j)
-            {
-                if (value < old_odf[nei[j]])
+            for (uint32_t j = neighbor_pos[index];j < neighbor_pos[index+1];++j)
+                if (value < odf[nei[j]])
                 {
                     is_max = false;
                     break;
                 }
+            if (!is_max)
+                continue;
+            // insertion into the sorted peak buffer, equal values keep the last index
+            unsigned int pos = 0;
+            while (pos < count && peak_value[pos] > value)
+                ++pos;
+            if (pos < count && peak_value[pos] == value)
+            {
+                peak_index[pos] = uint16_t(index);
+                continue;
+            }
+            if (pos == max_count)
+                continue;
+            if (count < max_count)
+                ++count;
+            for (unsigned int k = count-1;k > pos;--k)
+            {
+                peak_value[k] = peak_value[k-1];
+                peak_index[k] = peak_index[k-1];
             }
-            if (is_max)
-                max_table[value] = index;
+            peak_value[pos] = value;
+            peak_index[pos] = uint16_t(index);
         }
+        return count;
     }
 };
 
@@ -441,6 +560,11 @@ public:
         for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
             findex[index].resize(voxel.dim.size());
     }
+    virtual void run_block(Voxel& voxel,VoxelBlock& block)
+    {
+        for(auto& data : block)
+            SaveMetrics::run(voxel,data);
+    }
     virtual void run(Voxel& voxel, VoxelData& data)
     {
         data.min_odf = tipl::min_value(data.odf.begin(),data.odf.end());
@@ -493,15 +617,9 @@ public:
         }
         else
         {
-            std::map<float,unsigned short,std::greater<float> > max_table;
-            lm.search(data.odf,max_table);
-            auto iter = max_table.begin();
-            auto end = max_table.end();
-            for (unsigned int index = 0;iter != end && index < voxel.max_fiber_number;++index,++iter)
-            {
-                data.dir_index[index] = iter->second;
-                data.fa[index] = iter->first - data.min_odf;
-            }
+            unsigned int peak_count = lm.search(data.odf,&data.fa[0],&data.dir_index[0],voxel.max_fiber_number);
+            for (unsigned int index = 0;index < peak_count;++index)
+                data.fa[index] -= data.min_odf;
         }
 
         iso[data.voxel_index] = data.min_odf;
@@ -1,6 +1,7 @@
 #include <filesystem>
 #include "connectometry_db.hpp"
 #include "fib_data.hpp"
+#include "basic_voxel.hpp"
 
 bool parse_age_sex(const std::string& file_name,std::string& age,std::string& sex)
 {
@@ -635,6 +636,27 @@ bool connectometry_db::save_db(const char* output_name)
     return true;
 }
 
+// subject_qa of the given subjects transposed to fiber-voxel-major order,
+// matrix[s_index*subjects.size()+i] is the value of subjects[i] at s_index
+void connectometry_db::get_voxel_major(const std::vector<unsigned int>& subjects,std::vector<float>& matrix) const
+{
+    const size_t n = subjects.size();
+    const size_t tile = 1024;
+    matrix.resize(size_t(subject_qa_length)*n);
+    // each thread transposes a tile of fiber-voxels so that the output rows stay in cache
+    tipl::par_for((subject_qa_length+tile-1)/tile,[&](size_t t)
+    {
+        size_t from = t*tile;
+        size_t to = std::min<size_t>(subject_qa_length,from+tile);
+        for(size_t i = 0;i < n;++i)
+        {
+            const float* src = subject_qa[subjects[i]];
+            float* out = matrix.data()+from*n+i;
+            for(size_t s = from;s < to;++s,out += n)
+                *out = src[s];
+        }
+    });
+}
 void connectometry_db::get_subject_slice(unsigned int subject_index,unsigned char dim,unsigned int pos,
                         tipl::image<2,float>& slice) const
 {
@@ -1308,27 +1330,80 @@ bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap,unsigned int
                     permutation_order[i] = rand_gen(2);
             }
         }
+
+        sample_order.clear();
+        if(!resample_order.empty() || (study_feature && !permutation_order.empty()))
+        {
+            sample_order.resize(selected_subject.size());
+            for(unsigned int index = 0;index < sample_order.size();++index)
+            {
+                unsigned int j = (study_feature && !permutation_order.empty()) ? permutation_order[index] : index;
+                sample_order[index] = resample_order.empty() ? j : resample_order[j];
+            }
+        }
     }
 
     return true;
 }
-void stat_model::partial_correlation(std::vector<float>& population) const
+void stat_model::partial_correlation(float* population) const
 {
     if(!X.empty())
     {
         std::vector<double> b(x_col_count);
-        mr.regress(&*population.begin(),&*b.begin());
+        mr.regress(population,&*b.begin());
         for(size_t i = 1;i < x_col_count;++i) // skip intercept at i = 0
             if(i != study_feature)
             {
                 auto mean = X_mean[i];
                 auto cur_b = b[i];
-                for(size_t j = 0,p = i;j < population.size();++j,p += x_col_count)
+                for(size_t j = 0,p = i;j < selected_subject.size();++j,p += x_col_count)
                     population[j] -= (mr.X[p]-mean)*cur_b;
             }
     }
 }
-double stat_model::operator()(const std::vector<float>& original_population) const
+// adjusts count populations stored back to back, equivalent to calling partial_correlation
+// on each of them. The regression is linear in the population, so with P holding the covariate
+// coefficients of each unit population and C the centered covariates, y becomes y-C*P*y,
+// which is applied to blocks of populations as two matrix products.
+void stat_model::partial_correlation(float* populations,size_t count) const
+{
+    if(X.empty() || !count)
+        return;
+    const size_t n = selected_subject.size();
+    std::vector<size_t> covariates;
+    for(size_t i = 1;i < x_col_count;++i) // skip intercept at i = 0
+        if(i != study_feature)
+            covariates.push_back(i);
+    if(covariates.empty())
+        return;
+    const size_t k = covariates.size();
+    std::vector<float> Pt(n*k),Ct(k*n);
+    tipl::par_for(n,[&](size_t j)
+    {
+        std::vector<float> e(n);
+        std::vector<double> b(x_col_count);
+        e[j] = 1.0f;
+        mr.regress(&*e.begin(),&*b.begin());
+        for(size_t c = 0;c < k;++c)
+            Pt[j*k+c] = float(b[covariates[c]]);
+    });
+    for(size_t c = 0;c < k;++c)
+        for(size_t j = 0,p = covariates[c];j < n;++j,p += x_col_count)
+            Ct[c*n+j] = float(mr.X[p]-X_mean[covariates[c]]);
+
+    const size_t block_size = 256;
+    tipl::par_for((count+block_size-1)/block_size,[&](size_t block)
+    {
+        size_t m = std::min<size_t>(block_size,count-block*block_size);
+        float* Y = populations+block*block_size*n;
+        std::vector<float> B(m*k),D(m*n);
+        block_product(Y,&*Pt.begin(),&*B.begin(),m,n,k);
+        block_product(&*B.begin(),&*Ct.begin(),&*D.begin(),m,k,n);
+        for(size_t i = 0;i < D.size();++i)
+            Y[i] -= D[i];
+    });
+}
+double stat_model::operator()(const float* original_population) const
 {
     std::vector<float> population(selected_subject.size());
     // apply resampling
@@ -1338,7 +1413,7 @@ double stat_model::operator()(const std::vector<float>& original_population) con
             population[index] = original_population[resample_order[index]];
     }
     else
-        population = original_population;
+        std::copy(original_population,original_population+population.size(),population.begin());
 
     // apply permutation
     if(!permutation_order.empty())
@@ -1381,3 +1456,42 @@ double stat_model::operator()(const std::vector<float>& original_population) con
     }
     return 0.0;
 }
+// population_rank is tipl::rank of the unsampled population, computed once per voxel,
+// so that the rank after resampling and permutation only needs a counting sort
+double stat_model::operator()(const float* original_population,const uint16_t* population_rank,stat_buffer& buffer) const
+{
+    const size_t n = selected_subject.size();
+    auto source = [&](size_t k){return sample_order.empty() ? k : size_t(sample_order[k]);};
+    if(study_feature)
+    {
+        if(!population_rank)
+            return (*this)(original_population);
+        unsigned int base = *std::min_element(population_rank,population_rank+n);
+        auto& count = buffer.count;
+        count.assign(n+1,0);
+        for(size_t k = 0;k < n;++k)
+            ++count[population_rank[source(k)]-base+1];
+        for(size_t v = 1;v <= n;++v)
+            count[v] += count[v-1];
+        int64_t sum_d2 = 0;
+        for(size_t k = 0;k < n;++k)
+        {
+            int64_t d = int64_t(count[population_rank[source(k)]-base]++)+base-int64_t(x_study_feature_rank[k]);
+            sum_d2 += d*d;
+        }
+        double r = 1.0-double(sum_d2)*rank_c;
+        double result = r*std::sqrt(double(n-2.0)/(1.0-r*r));
+        return std::isnormal(result) ? result : 0.0;
+    }
+    // if study longitudinal change
+    auto& population = buffer.population;
+    population.resize(n);
+    for(size_t k = 0;k < n;++k)
+        population[k] = original_population[source(k)];
+    if(!permutation_order.empty())
+        for(size_t k = 0;k < n;++k)
+            population[k] = permutation_order[k] ? -population[k] : 0.0f;
+    double mean = tipl::mean(population);
+    double se = tipl::standard_deviation(population.begin(),population.end(),mean)/std::sqrt(population.size());
+    return se == 0.0 ? 0.0 : mean/se;
+}
@@ -58,6 +58,7 @@ public:
     bool save_demo_matched_image(const std::string& matched_demo,const std::string& filename) const;
     void get_subject_volume(unsigned int subject_index,tipl::image<3>& volume) const;
     void get_subject_fa(unsigned int subject_index,std::vector<std::vector<float> >& fa_data) const;
+    void get_voxel_major(const std::vector<unsigned int>& subjects,std::vector<float>& matrix) const;
     bool get_qa_profile(const char* file_name,std::vector<std::vector<float> >& data);
     bool is_db_compatible(const connectometry_db& rhs);
     bool add_db(const connectometry_db& rhs);
@@ -68,11 +69,19 @@ public:
 
 
 
+// per-thread working memory for evaluating stat_model without allocation
+struct stat_buffer{
+    std::vector<float> population;
+    std::vector<unsigned int> count;
+};
+
 class stat_model{
 public:
     std::vector<unsigned int> selected_subject;
     std::vector<unsigned int> resample_order;
     std::vector<unsigned int> permutation_order;
+    // population[k] is taken from subject sample_order[k] after resampling and permutation
+    std::vector<unsigned int> sample_order;
 public: // multiple regression
     std::vector<double> X,X_min,X_max,X_range,X_mean;
     unsigned int x_col_count = 0;
@@ -104,8 +113,10 @@ public:
     void read_demo(const connectometry_db& db);
     bool resample(stat_model& rhs,bool null,bool bootstrap,unsigned int seed);
     bool pre_process(void);
-    void partial_correlation(std::vector<float>& population) const;
-    double operator()(const std::vector<float>& population) const;
+    void partial_correlation(float* population) const;
+    void partial_correlation(float* populations,size_t count) const;
+    double operator()(const float* population) const;
+    double operator()(const float* population,const uint16_t* population_rank,stat_buffer& buffer) const;
     void clear(void)
     {
         X.clear();
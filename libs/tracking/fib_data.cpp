@@ -266,6 +266,51 @@ bool fiber_directions::set_tracking_index(int new_index)
     cur_index = new_index;
     return true;
 }
+std::shared_ptr<const fiber_pack> fiber_directions::get_fiber_pack(void)
+{
+    if(fa.empty())
+        return nullptr;
+    if(packed_fibers.get() && packed_fibers->source_fa == fa[0])
+        return packed_fibers->data.empty() ? nullptr : packed_fibers;
+    packed_fibers = std::make_shared<fiber_pack>();
+    packed_fibers->source_fa = fa[0];
+    size_t stride = size_t(num_fiber) << 2;
+    size_t count = 1; // the first entry is kept empty for voxels without fibers
+    {
+        size_t fiber_voxel_count = 0;
+        for(size_t i = 0;i < dim.size();++i)
+            if(fa[0][i] > 0.0f)
+                ++fiber_voxel_count;
+        // offsets are stored as uint32_t, large volumes fall back to the unpacked lookup
+        if(stride*(fiber_voxel_count+1) > std::numeric_limits<uint32_t>::max())
+        {
+            tipl::out() << "fiber packing skipped: " << fiber_voxel_count << " fiber voxels exceed the packing limit";
+            return nullptr;
+        }
+    }
+    auto& pos = packed_fibers->pos;
+    auto& data = packed_fibers->data;
+    pos.resize(dim);
+    for(size_t i = 0;i < dim.size();++i)
+        if(fa[0][i] > 0.0f)
+            pos[i] = uint32_t(stride*count++);
+    data.resize(stride*count);
+    tipl::adaptive_par_for(dim.size(),[&](size_t i)
+    {
+        if(!pos[i])
+            return;
+        float* p = &data[pos[i]];
+        for(unsigned char fib = 0;fib < num_fiber;++fib,p += 4)
+        {
+            auto d = get_fib(i,fib);
+            p[0] = fa[fib][i];
+            p[1] = d[0];
+            p[2] = d[1];
+            p[3] = d[2];
+        }
+    });
+    return packed_fibers;
+}
 bool fiber_directions::set_tracking_index(const std::string& name)
 {
     return set_tracking_index(std::find(index_name.begin(),index_name.end(),name)-index_name.begin());
@@ -336,7 +381,6 @@ void tracking_data::read(std::shared_ptr<fib_data> fib)
     if(!dt_fa.empty())
         dt_metrics= fib->dir.dt_metrics;
 }
-
 void initial_LPS_nifti_srow(tipl::matrix<4,4>& T,const tipl::shape<3>& geo,const tipl::vector<3>& vs)
 {
     std::fill(T.begin(),T.end(),0.0f);
@@ -1601,6 +1645,23 @@ bool fib_data::load_track_atlas()
         });
         tract_atlas_min_length.swap(min_length);
         tract_atlas_max_length.swap(max_length);
+
+        // bounding boxes used to prune candidates in recognize
+        std::vector<tipl::vector<3> > box_min(tract_data.size()),box_max(tract_data.size());
+        tipl::adaptive_par_for(tract_data.size(),[&](size_t i)
+        {
+            if(tract_data[i].empty())
+                return;
+            box_min[i] = box_max[i] = tipl::vector<3>(&tract_data[i][0]);
+            for(size_t pos = 3;pos < tract_data[i].size();pos += 3)
+                for(size_t d = 0;d < 3;++d)
+                {
+                    box_min[i][d] = std::min<float>(box_min[i][d],tract_data[i][pos+d]);
+                    box_max[i][d] = std::max<float>(box_max[i][d],tract_data[i][pos+d]);
+                }
+        });
+        tract_atlas_box_min.swap(box_min);
+        tract_atlas_box_max.swap(box_max);
     }
     return true;
 }
@@ -1640,52 +1701,62 @@ std::pair<float,float> fib_data::get_track_minmax_length(const std::string& trac
 template<typename T,typename U>
 unsigned int find_nearest_contain(const float* trk,unsigned int length,
                           const T& tract_data,// = track_atlas->get_tracts();
-                          const U& tract_cluster)
+                          const U& tract_cluster,
+                          const std::vector<tipl::vector<3> >& box_min,
+                          const std::vector<tipl::vector<3> >& box_max)
 {
-    struct norm1_imp{
-        inline float operator()(const float* v1,const float* v2)
-        {
-            return std::fabs(v1[0]-v2[0])+std::fabs(v1[1]-v2[1])+std::fabs(v1[2]-v2[2]);
-        }
-    } norm1;
-
-    struct min_min_imp{
-        inline float operator()(float min_dis,const float* v1,const float* v2)
+    // the distance from a sampled point to the bounding box bounds the distance from below
+    const float* last = trk+(length ? (length-1)/6*6 : 0);
+    auto lower_bound = [&](size_t i)
+    {
+        float d1 = 0.0f,d2 = 0.0f;
+        for(size_t d = 0;d < 3;++d)
         {
-            float d1 = std::fabs(v1[0]-v2[0]);
-            if(d1 > min_dis)                    return min_dis;
-            d1 += std::fabs(v1[1]-v2[1]);
-            if(d1 > min_dis)                    return min_dis;
-            d1 += std::fabs(v1[2]-v2[2]);
-            if(d1 > min_dis)                    return min_dis;
-            return d1;
+            d1 += std::max<float>(0.0f,std::max<float>(box_min[i][d]-trk[d],trk[d]-box_max[i][d]));
+            d2 += std::max<float>(0.0f,std::max<float>(box_min[i][d]-last[d],last[d]-box_max[i][d]));
         }
-    }min_min;
+        return std::max<float>(d1,d2);
+    };
     size_t best_index = tract_data.size();
     float best_distance = std::numeric_limits<float>::max();
-    for(size_t i = 0;i < tract_data.size();++i)
+    auto check = [&](size_t i)
     {
-        bool skip = false;
         float max_dis = 0;
         for(size_t n = 0;n < length;n += 6)
         {
-            float min_dis = norm1(&tract_data[i][0],trk+n);
-            for(size_t m = 0;m < tract_data[i].size() && min_dis > max_dis;m += 3)
-                min_dis = min_min(min_dis,&tract_data[i][m],trk+n);
+            float min_dis = min_distance_to_tract(trk+n,&tract_data[i][0],uint32_t(tract_data[i].size()),
+                                                  std::numeric_limits<float>::max(),max_dis);
             if(min_dis > max_dis)
                 max_dis = min_dis;
             if(max_dis > best_distance)
-            {
-                skip = true;
-                break;
-            }
+                return;
         }
-        if(!skip && max_dis < best_distance)
+        // ties go to the lower index as in a sequential scan
+        if(max_dis < best_distance || (max_dis == best_distance && i < best_index))
         {
             best_distance = max_dis;
             best_index = i;
         }
+    };
+    // start from the closest bounding box to get a tight threshold early
+    {
+        size_t first = tract_data.size();
+        float first_bound = std::numeric_limits<float>::max();
+        for(size_t i = 0;i < tract_data.size();++i)
+        {
+            float bound = lower_bound(i);
+            if(bound < first_bound)
+            {
+                first_bound = bound;
+                first = i;
+            }
+        }
+        if(first < tract_data.size())
+            check(first);
     }
+    for(size_t i = 0;i < tract_data.size();++i)
+        if(i != best_index && lower_bound(i) <= best_distance)
+            check(i);
     return tract_cluster[best_index];
 }
 
@@ -1706,7 +1777,8 @@ bool fib_data::recognize(std::shared_ptr<TractModel>& trk,
         if(trk->get_tracts()[i].empty() || prog.aborted())
             return;
         prog(total++,trk->get_tracts().size());
-        labels[i] = find_nearest_contain(&(trk->get_tracts()[i][0]),uint32_t(trk->get_tracts()[i].size()),track_atlas->get_tracts(),track_atlas->tract_cluster);
+        labels[i] = find_nearest_contain(&(trk->get_tracts()[i][0]),uint32_t(trk->get_tracts()[i].size()),track_atlas->get_tracts(),track_atlas->tract_cluster,
+                                         tract_atlas_box_min,tract_atlas_box_max);
     },std::thread::hardware_concurrency());
     if(prog.aborted())
         return false;
@@ -17,6 +17,13 @@ public:
     const float* get_odf_data(size_t index){return odf_map[index];}
 };
 
+// each voxel with fibers stores fib_num x (fa,x,y,z) contiguously
+struct fiber_pack{
+    std::vector<float> data;
+    tipl::image<3,uint32_t> pos; // 0: voxel without fibers
+    const float* source_fa = nullptr; // fa[0] the pack was built from
+};
+
 class fiber_directions
 {
 public:
@@ -52,6 +59,11 @@ public:
     float cos_angle(const tipl::vector<3>& cur_dir,size_t space_index,unsigned char fib_order) const;
     float get_track_specific_metrics(size_t space_index,const std::vector<const float*>& index,
                              const tipl::vector<3,float>& dir) const;
+private:
+    std::shared_ptr<fiber_pack> packed_fibers;
+public:
+    // built once and kept until the tracking index changes, nullptr if the volume is too large to pack
+    std::shared_ptr<const fiber_pack> get_fiber_pack(void);
 };
 
 class tracking_data{
@@ -66,6 +78,8 @@ public:
     std::vector<const float*> dt_fa;
     std::vector<const short*> findex;
     std::vector<tipl::vector<3,float> > odf_table;
+public:
+    std::shared_ptr<const fiber_pack> packed_fibers;
 
     const tracking_data& operator=(const tracking_data& rhs) = delete;
 public:
@@ -83,6 +97,48 @@ public:
             return false;
         tipl::vector<3,float> new_dir,main_dir;
         float total_weighting = 0.0f;
+        if(packed_fibers.get() && dt_fa.empty())
+        {
+            const auto& pack_data = packed_fibers->data;
+            const auto& pack_pos = packed_fibers->pos;
+            for (unsigned char index = 0;index < 8;++index)
+            {
+                const float* p = &pack_data[pack_pos[tri_interpo.dindex[index]]];
+                float max_value = cull_cos_angle;
+                const float* max_dir = nullptr;
+                float sign = 1.0f;
+                for (unsigned char fib = 0;fib < fib_num && p[0] > threshold;++fib,p += 4)
+                {
+                    float value = ref_dir[0]*p[1] + ref_dir[1]*p[2] + ref_dir[2]*p[3];
+                    if (-value > max_value)
+                    {
+                        max_value = -value;
+                        max_dir = p+1;
+                        sign = -1.0f;
+                    }
+                    else
+                        if (value > max_value)
+                        {
+                            max_value = value;
+                            max_dir = p+1;
+                            sign = 1.0f;
+                        }
+                }
+                if (!max_dir)
+                    continue;
+                float w = tri_interpo.ratio[index];
+                float sw = sign*w;
+                new_dir[0] += max_dir[0]*sw;
+                new_dir[1] += max_dir[1]*sw;
+                new_dir[2] += max_dir[2]*sw;
+                total_weighting += w;
+            }
+            if (total_weighting < 0.5f)
+                return false;
+            new_dir.normalize();
+            result = new_dir;
+            return true;
+        }
         for (unsigned char index = 0;index < 8;++index)
         {
             size_t space_index = tri_interpo.dindex[index];
@@ -279,6 +335,7 @@ public:
     std::shared_ptr<TractModel> track_atlas;
     std::vector<float> tract_atlas_min_length,tract_atlas_max_length;
     float tract_atlas_jacobian = 0.0f;
+    std::vector<tipl::vector<3> > tract_atlas_box_min,tract_atlas_box_max; // bounding box of each atlas tract in subject space
     bool recognize(std::shared_ptr<TractModel>& trk,
                    std::vector<unsigned int>& labels,
                    std::vector<unsigned int>& label_count);
@@ -5,13 +5,21 @@ bool RoiMgr::setAtlas(bool& terminated,float seed_threshold,float not_end_thresh
     if(!handle->load_track_atlas())
         return false;
     tipl::progress prog("loading atlas regions");
-    track_ids = handle->get_track_ids(tract_name);
-    if(track_ids.empty())
+    auto names = tract_names.empty() ? std::vector<std::string>{tract_name} : tract_names;
+    track_ids.clear();
+    for(const auto& name : names)
     {
-        handle->error_msg = "invalid tract name: ";
-        handle->error_msg += tract_name;
-        return false;
+        auto ids = handle->get_track_ids(name);
+        if(ids.empty())
+        {
+            handle->error_msg = "invalid tract name: ";
+            handle->error_msg += name;
+            return false;
+        }
+        track_ids.insert(track_ids.end(),ids.begin(),ids.end());
     }
+    std::sort(track_ids.begin(),track_ids.end());
+    track_ids.erase(std::unique(track_ids.begin(),track_ids.end()),track_ids.end());
     if(terminated)
         return false;
 
@@ -22,9 +30,13 @@ bool RoiMgr::setAtlas(bool& terminated,float seed_threshold,float not_end_thresh
                                 tolerance_dis_in_subject_voxels << " subject voxels" << std::endl;
     }
 
-    std::vector<tipl::vector<3,short> > tract_coverage;
+    const float *fa0 = handle->dir.fa[0];
+    // tolerance region around the atlas tracts of the given clusters. with multiple bundles,
+    // a side is limited only if all bundles are on that side
+    auto get_limiting_mask = [&](const std::vector<size_t>& ids,const std::vector<std::string>& bundle_names)
     {
-        for(auto id : track_ids)
+        std::vector<tipl::vector<3,short> > tract_coverage;
+        for(auto id : ids)
         {
             std::vector<tipl::vector<3,short> > region;
             handle->track_atlas->to_voxel(region,tipl::identity_matrix(),int(id));
@@ -38,25 +50,22 @@ bool RoiMgr::setAtlas(bool& terminated,float seed_threshold,float not_end_thresh
             else
                 region.swap(tract_coverage);
         }
-    }
-
-
-
-    {
-        // add limiting region to speed up tracking
-        tipl::out() << "creating limiting region to limit tracking results" << std::endl;
 
-        bool is_left = (tract_name.back() == 'L' || tipl::contains(tract_name,"L_")) ;
-        bool is_right = (tract_name.back() == 'R' || tipl::contains(tract_name,"R_"));
+        bool is_left = true,is_right = true;
+        for(const auto& name : bundle_names)
+        {
+            is_left = is_left && (name.back() == 'L' || tipl::contains(name,"L_"));
+            is_right = is_right && (name.back() == 'R' || tipl::contains(name,"R_"));
+        }
         auto mid_x = handle->template_I.width() >> 1;
         auto& s2t = handle->get_sub2temp_mapping();
+        auto mask_name = bundle_names.size() == 1 ? bundle_names[0] : std::string("all bundles");
         if(is_left)
-            tipl::out() << "apply left limiting mask for " << tract_name << std::endl;
+            tipl::out() << "apply left limiting mask for " << mask_name << std::endl;
         if(is_right)
-            tipl::out() << "apply right limiting mask for " << tract_name << std::endl;
+            tipl::out() << "apply right limiting mask for " << mask_name << std::endl;
 
         tipl::image<3,char> limiting_mask(handle->dim);
-        const float *fa0 = handle->dir.fa[0];
         tipl::adaptive_par_for(tract_coverage.size(),[&](unsigned int i)
         {
             tipl::for_each_neighbors(tipl::pixel_index<3>(tract_coverage[i].begin(),handle->dim),
@@ -72,6 +81,13 @@ bool RoiMgr::setAtlas(bool& terminated,float seed_threshold,float not_end_thresh
                 limiting_mask[pos.index()] = 1;
             });
         });
+        return limiting_mask;
+    };
+
+    {
+        // add limiting region to speed up tracking
+        tipl::out() << "creating limiting region to limit tracking results" << std::endl;
+        auto limiting_mask = get_limiting_mask(track_ids,names);
         if(terminated)
             return false;
 
@@ -99,10 +115,83 @@ bool RoiMgr::setAtlas(bool& terminated,float seed_threshold,float not_end_thresh
         if(!atlas_not_end.empty())
             setRegions(atlas_not_end,not_end_id,"white matter region");
         if(seeds.empty())
-            setRegions(atlas_seed,seed_id,tract_name.c_str());
+            setRegions(atlas_seed,seed_id,tract_names.empty() ? tract_name.c_str() : "all bundles");
 
     }
 
+    // the union seed region is smaller than the sum of the bundle seed regions where bundles overlap.
+    // count each bundle's own seed region so that every bundle gets the density of per-bundle tracking
+    bundle_seed_count = 0;
+    if(names.size() > 1)
+    {
+        tipl::out() << "counting seed voxels of each bundle" << std::endl;
+        for(const auto& name : names)
+        {
+            auto limiting_mask = get_limiting_mask(handle->get_track_ids(name),{name});
+            std::vector<size_t> seed_count(tipl::max_thread_count);
+            tipl::par_for<tipl::sequential_with_id>(limiting_mask.size(),[&](size_t i,unsigned int thread_id)
+            {
+                if(limiting_mask[i] && fa0[i] >= seed_threshold)
+                    ++seed_count[thread_id];
+            });
+            bundle_seed_count += std::accumulate(seed_count.begin(),seed_count.end(),size_t(0));
+            if(terminated)
+                return false;
+        }
+        tipl::out() << "total seed voxels of all bundles: " << bundle_seed_count << std::endl;
+    }
+
+    // bundle-specific ROI and ROA are checked per bundle after tracking multiple bundles
+    if(tract_names.empty() && !setAtlasRegions())
+        return false;
+    {
+        const auto& atlas_tract = handle->track_atlas->get_tracts();
+        const auto& atlas_cluster = handle->track_atlas->tract_cluster;
+        auto tolerance_dis_in_subject_voxels2 = tolerance_dis_in_subject_voxels*2;
+
+        std::vector<bool> is_target(atlas_tract.size());
+        tipl::adaptive_par_for(atlas_tract.size(),[&](unsigned int i)
+        {
+            is_target[i] = (std::find(track_ids.begin(),track_ids.end(),atlas_cluster[i]) != track_ids.end());
+        });
+
+        tract_end_grid target_grid;
+        target_grid.build(atlas_tract,tolerance_dis_in_subject_voxels2,[&](size_t i){return bool(is_target[i]);});
+
+        std::vector<std::vector<std::vector<float> > > selected_atlas_tracts_threads(tipl::max_thread_count);
+        std::vector<std::vector<unsigned int> > selected_atlas_cluster_threads(tipl::max_thread_count);
+        std::vector<std::vector<uint32_t> > candidates_threads(tipl::max_thread_count);
+        tipl::par_for<tipl::sequential_with_id>(atlas_tract.size(),[&](unsigned int i,unsigned int id)
+        {
+            if(!is_target[i])
+            {
+                bool needed = false;
+                auto& candidates = candidates_threads[id];
+                target_grid.get_candidates(&atlas_tract[i][0],candidates);
+                for(auto j : candidates)
+                {
+                    if(distance_over_limit(&atlas_tract[i][0],atlas_tract[i].size(),
+                                           &atlas_tract[j][0],atlas_tract[j].size(),
+                                           tolerance_dis_in_subject_voxels2))
+                        continue;
+                    needed = true;
+                    break;
+                }
+                if(!needed)
+                    return;
+            }
+            selected_atlas_tracts_threads[id].push_back(atlas_tract[i]);
+            selected_atlas_cluster_threads[id].push_back(atlas_cluster[i]);
+
+        });
+        tipl::aggregate_results(std::move(selected_atlas_tracts_threads),selected_atlas_tracts);
+        tipl::aggregate_results(std::move(selected_atlas_cluster_threads),selected_atlas_cluster);
+        selected_atlas_grid.build(selected_atlas_tracts,tolerance_dis_in_subject_voxels,[](size_t){return true;});
+    }
+    return true;
+}
+bool RoiMgr::setAtlasRegions(void)
+{
     if(handle->tractography_atlas_roi.get())
     {
         const auto& regions = handle->tractography_atlas_roi->get_list();
@@ -143,43 +232,5 @@ bool RoiMgr::setAtlas(bool& terminated,float seed_threshold,float not_end_thresh
                 setRegions(atlas_roa,roa_id,regions[i].c_str());
             }
     }
-    {
-        const auto& atlas_tract = handle->track_atlas->get_tracts();
-        const auto& atlas_cluster = handle->track_atlas->tract_cluster;
-        auto tolerance_dis_in_subject_voxels2 = tolerance_dis_in_subject_voxels*2;
-
-        std::vector<bool> is_target(atlas_tract.size());
-        tipl::adaptive_par_for(atlas_tract.size(),[&](unsigned int i)
-        {
-            is_target[i] = (std::find(track_ids.begin(),track_ids.end(),atlas_cluster[i]) != track_ids.end());
-        });
-
-        std::vector<std::vector<std::vector<float> > > selected_atlas_tracts_threads(tipl::max_thread_count);
-        std::vector<std::vector<unsigned int> > selected_atlas_cluster_threads(tipl::max_thread_count);
-        tipl::par_for<tipl::sequential_with_id>(atlas_tract.size(),[&](unsigned int i,unsigned int id)
-        {
-            if(!is_target[i])
-            {
-                bool needed = false;
-                for(size_t j = 0;j < atlas_tract.size();++j)
-                    if(is_target[j])
-                    {
-                        if(distance_over_limit(&atlas_tract[i][0],atlas_tract[i].size(),
-                                               &atlas_tract[j][0],atlas_tract[j].size(),
-                                               tolerance_dis_in_subject_voxels2))
-                            continue;
-                        needed = true;
-                        break;
-                    }
-                if(!needed)
-                    return;
-            }
-            selected_atlas_tracts_threads[id].push_back(atlas_tract[i]);
-            selected_atlas_cluster_threads[id].push_back(atlas_cluster[i]);
-
-        });
-        tipl::aggregate_results(std::move(selected_atlas_tracts_threads),selected_atlas_tracts);
-        tipl::aggregate_results(std::move(selected_atlas_cluster_threads),selected_atlas_cluster);
-    }
     return true;
 }
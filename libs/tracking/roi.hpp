@@ -1,6 +1,7 @@
 #ifndef ROI_HPP
 #include <functional>
 #include <set>
+#include <unordered_map>
 #include "tract_model.hpp"
 #include "tracking/region/Regions.h"
 class Roi {
@@ -74,27 +75,39 @@ public:
 };
 
 
+// L1 distance from point p to the nearest point of trk. Points are compared eight at a
+// time without branches so that the compiler can vectorize the block, and the search
+// stops once the distance is no more than stop_dis.
+__INLINE__ float min_distance_to_tract(const float* p,const float* trk,unsigned int length,
+                                       float min_dis,float stop_dis)
+{
+    const float x = p[0],y = p[1],z = p[2];
+    auto end = trk+length;
+    for(;trk+24 <= end && min_dis > stop_dis;trk += 24)
+    {
+        float d[8];
+        for(int k = 0;k < 8;++k)
+            d[k] = std::fabs(trk[k*3]-x)+std::fabs(trk[k*3+1]-y)+std::fabs(trk[k*3+2]-z);
+        for(int k = 0;k < 8;++k)
+            min_dis = (d[k] < min_dis ? d[k] : min_dis);
+    }
+    for(;trk < end && min_dis > stop_dis;trk += 3)
+    {
+        float d = std::fabs(trk[0]-x)+std::fabs(trk[1]-y)+std::fabs(trk[2]-z);
+        min_dis = (d < min_dis ? d : min_dis);
+    }
+    return min_dis;
+}
+
 __INLINE__ float get_distance_one_way(const float* trk1,unsigned int length1,
                               const float* trk2,unsigned int length2,
                               float max_dis,
                               float max_dis_limit)
 {
-    struct update_min_dis_imp{
-        __INLINE__ void operator()(float& min_dis,const float* v1,const float* v2)
-        {
-            float d1 = std::fabs(v1[0]-v2[0]);if(d1 > min_dis)return;
-            d1 += std::fabs(v1[1]-v2[1]);if(d1 > min_dis)return;
-            d1 += std::fabs(v1[2]-v2[2]);if(d1 < min_dis)min_dis = d1;
-        }
-    }update_min_dis;
-    auto trk1_end = trk1+length1;
     auto trk2_end = trk2+length2;
-
     for(auto trk2_n = trk2;trk2_n < trk2_end;trk2_n += 3)
     {
-        float min_dis = max_dis_limit;
-        for(auto trk1_n = trk1;trk1_n < trk1_end && min_dis > max_dis;trk1_n += 3)
-            update_min_dis(min_dis,trk2_n,trk1_n);
+        float min_dis = min_distance_to_tract(trk2_n,trk1,length1,max_dis_limit,max_dis);
         if(min_dis >= max_dis_limit)
             return max_dis_limit;
         if(min_dis > max_dis)
@@ -161,6 +174,87 @@ __DEVICE_HOST__ unsigned int find_nearest(const float* trk,unsigned int length,
     return best_cluster;
 }
 
+// hash grid over tract end points. With a cell size no smaller than the distance
+// limit, any point within the limit of a query point lies in the 27 cells around it
+class tract_end_grid{
+    float cell_size = 1.0f;
+    std::unordered_map<uint64_t,std::vector<uint32_t> > cells;
+    static uint64_t get_key(int x,int y,int z)
+    {
+        return (uint64_t(uint32_t(x+(1 << 20)) & 0x1FFFFF) << 42) |
+               (uint64_t(uint32_t(y+(1 << 20)) & 0x1FFFFF) << 21) |
+                uint64_t(uint32_t(z+(1 << 20)) & 0x1FFFFF);
+    }
+public:
+    bool empty(void) const{return cells.empty();}
+    void clear(float distance_limit)
+    {
+        cells.clear();
+        cell_size = std::max<float>(distance_limit,1.0f);
+    }
+    void add(const float* point,uint32_t id)
+    {
+        cells[get_key(int(std::floor(point[0]/cell_size)),
+                      int(std::floor(point[1]/cell_size)),
+                      int(std::floor(point[2]/cell_size)))].push_back(id);
+    }
+    // index the first point of each included tract
+    template<typename T,typename pred_type>
+    void build(const T& tract_data,float distance_limit,pred_type&& include)
+    {
+        clear(distance_limit);
+        for(size_t i = 0;i < tract_data.size();++i)
+            if(!tract_data[i].empty() && include(i))
+                add(&tract_data[i][0],uint32_t(i));
+    }
+    // candidates are returned in ascending order
+    void get_candidates(const float* trk,std::vector<uint32_t>& candidates) const
+    {
+        candidates.clear();
+        int x = int(std::floor(trk[0]/cell_size));
+        int y = int(std::floor(trk[1]/cell_size));
+        int z = int(std::floor(trk[2]/cell_size));
+        for(int dz = -1;dz <= 1;++dz)
+            for(int dy = -1;dy <= 1;++dy)
+                for(int dx = -1;dx <= 1;++dx)
+                {
+                    auto iter = cells.find(get_key(x+dx,y+dy,z+dz));
+                    if(iter != cells.end())
+                        candidates.insert(candidates.end(),iter->second.begin(),iter->second.end());
+                }
+        std::sort(candidates.begin(),candidates.end());
+    }
+};
+
+template<typename T,typename U>
+unsigned int find_nearest(const float* trk,unsigned int length,
+                          const T& tract_data,
+                          const U& tract_cluster,
+                          const tract_end_grid& grid,
+                          float tolerance_dis_in_subject_voxels,
+                          std::vector<uint32_t>& candidates) // scratch buffer reused across calls
+{
+    if(length <= 6)
+        return 9999;
+    grid.get_candidates(trk,candidates);
+    float best_distance = tolerance_dis_in_subject_voxels;
+    unsigned int best_cluster = 9999;
+    for(auto i : candidates)
+    {
+        if(tract_data[i].size() <= 6)
+            continue;
+        if(distance_over_limit(&tract_data[i][0],tract_data[i].size(),trk,length,best_distance))
+            continue;
+        float min_dis = get_distance(&tract_data[i][0],tract_data[i].size(),trk,length,tolerance_dis_in_subject_voxels);
+        if(min_dis < best_distance)
+        {
+            best_distance = min_dis;
+            best_cluster = tract_cluster[i];
+        }
+    }
+    return best_cluster;
+}
+
 class RoiMgr {
 public:
     std::shared_ptr<fib_data> handle;
@@ -178,6 +272,8 @@ public:
     float tolerance_dis_in_subject_voxels = 0.0f;
     std::vector<size_t> track_ids;
     std::string tract_name;
+    std::vector<std::string> tract_names; // multiple bundles tracked in one run
+    size_t bundle_seed_count = 0;         // sum of the seed region size of each bundle in tract_names
 public:
     RoiMgr(std::shared_ptr<fib_data> handle_):handle(handle_){}
 public:
@@ -235,27 +331,46 @@ public:
         }
         return false;
     }
-    bool within_roi(const float* track,unsigned int buffer_size) const
+    // nearest_id receives the atlas cluster nearest to the track when an atlas is used
+    bool within_roi(const float* track,unsigned int buffer_size,
+                    std::vector<uint32_t>& candidates,unsigned int& nearest_id) const
     {
         for(unsigned int index = 0; index < roi.size(); ++index)
             if(!roi[index]->included(track,buffer_size))
                 return false;
         if(!selected_atlas_tracts.empty())
         {
-            auto nearest_id = find_nearest(track,buffer_size,
+            nearest_id = find_nearest(track,buffer_size,
                                 selected_atlas_tracts,
                                 selected_atlas_cluster,
-                                tolerance_dis_in_subject_voxels);
+                                selected_atlas_grid,
+                                tolerance_dis_in_subject_voxels,
+                                candidates);
             return std::find(track_ids.begin(),track_ids.end(),nearest_id) != track_ids.end();
         }
         return true;
     }
+    bool within_roi(const float* track,unsigned int buffer_size) const
+    {
+        std::vector<uint32_t> candidates;
+        unsigned int nearest_id;
+        return within_roi(track,buffer_size,candidates,nearest_id);
+    }
 public:
     std::vector<tipl::vector<3,short> > atlas_seed,atlas_limiting,atlas_not_end,atlas_roi,atlas_roa;
     std::vector<std::vector<float> > selected_atlas_tracts;
     std::vector<unsigned int> selected_atlas_cluster;
+    tract_end_grid selected_atlas_grid;
 public:
     bool setAtlas(bool& terminated,float seed_threshold,float not_end_threshold);
+    bool setAtlasRegions(void);
+    bool fulfill_regions(const float* track,unsigned int buffer_size) const
+    {
+        for(unsigned int i = 0;i < buffer_size;i += 3)
+            if(within_roa(tipl::vector<3,float>(track+i)))
+                return false;
+        return within_roi(track,buffer_size);
+    }
 
     void setWholeBrainSeed(float threshold)
     {
@@ -176,6 +176,7 @@ public:
     float current_step_size_in_voxel[3];
     unsigned int current_min_steps3;
     unsigned int current_max_steps3;
+    unsigned int nearest_cluster = 9999; // atlas cluster of the last accepted track
     void scaling_in_voxel(tipl::vector<3,float>& dir) const
     {
         dir[0] *= current_step_size_in_voxel[0];
@@ -186,6 +187,7 @@ private:
     std::shared_ptr<RoiMgr> roi_mgr;
 	std::vector<float> track_buffer;
 	mutable std::vector<float> reverse_buffer;
+    std::vector<uint32_t> atlas_candidates;
     unsigned int buffer_front_pos;
     unsigned int buffer_back_pos;
     unsigned char init_fib_index;
@@ -273,7 +275,7 @@ public:
 
 
         return get_buffer_size() >= current_min_steps3 &&
-               roi_mgr->within_roi(get_result(),get_buffer_size()) &&
+               roi_mgr->within_roi(get_result(),get_buffer_size(),atlas_candidates,nearest_cluster) &&
                roi_mgr->fulfill_end_point(position,end_point1);
 
 
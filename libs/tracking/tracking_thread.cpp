@@ -31,7 +31,7 @@ void ThreadData::run_thread(unsigned int thread_id,unsigned int thread_count)
             continue;
         }
         {
-            seed = std::mt19937(param.random_seed);  // always 0, except in connectometry for changing seed sequence
+            seed_number = 0;  // random_seed is always 0, except in connectometry for changing seed sequence
             if(roi_mgr->use_auto_track)
             {
                 if(!roi_mgr->setAtlas(joining,fa_threshold1,param.check_ending ? fa_threshold2+fa_threshold2-fa_threshold1 : 0.0f))
@@ -46,7 +46,8 @@ void ThreadData::run_thread(unsigned int thread_id,unsigned int thread_count)
 
             if(param.termination_count == 0)
             {
-                param.termination_count = std::max<uint32_t>(1,roi_mgr->track_voxel_ratio*roi_mgr->seeds.size());
+                param.termination_count = std::max<uint32_t>(1,roi_mgr->track_voxel_ratio*
+                        (roi_mgr->bundle_seed_count ? roi_mgr->bundle_seed_count : roi_mgr->seeds.size()));
                 param.max_seed_count = param.termination_count*5000; //yield rate easy:1/100 hard:1/5000
             }
         }
@@ -70,6 +71,7 @@ void ThreadData::run_thread(unsigned int thread_id,unsigned int thread_count)
         param.termination_count-(param.termination_count/thread_count)*(thread_count-1):
         param.termination_count/thread_count);
     unsigned int max_seed_per_thread = param.max_seed_count/thread_count;
+    bool record_cluster = !roi_mgr->tract_names.empty();
     if(!roi_mgr->seeds.empty())
     try{
         while(!joining &&
@@ -84,20 +86,19 @@ void ThreadData::run_thread(unsigned int thread_id,unsigned int thread_count)
 
             // random generators
             {
-                // this ensure consistency
-                std::lock_guard<std::mutex> lock(lock_seed_function);
+                seed_generator gen(param.random_seed,seed_number++);
                 if(param.threshold == 0.0f)
                 {
-                    float w = threshold_gen(seed);
+                    float w = gen(0.0f,1.0f);
                     method->current_fa_threshold = w*fa_threshold1 + (1.0f-w)*fa_threshold2;
                 }
                 if(param.cull_cos_angle == 1.0f)
-                    method->current_tracking_angle = std::cos(angle_gen(seed));
+                    method->current_tracking_angle = std::cos(gen(float(45.0f*M_PI/180.0f),float(90.0f*M_PI/180.0f)));
                 if(param.smooth_fraction == 1.0f)
-                    method->current_tracking_smoothing = smoothing_gen(seed);
+                    method->current_tracking_smoothing = gen(0.0f,0.95f);
                 if(param.step_size <= 0.0f) // 0: same as voxel spacing   -1: previous version voxel_size* [0.5 1.5]
                 {
-                    float step_size_in_voxel = (param.step_size == 0 ? 1.0f : step_gen(seed));
+                    float step_size_in_voxel = (param.step_size == 0 ? 1.0f : gen(0.5f,1.5f));
                     float step_size_in_mm = step_size_in_voxel*method->trk->vs[0];
                     method->current_step_size_in_voxel[0] = step_size_in_voxel;
                     method->current_step_size_in_voxel[1] = step_size_in_voxel;
@@ -106,10 +107,12 @@ void ThreadData::run_thread(unsigned int thread_id,unsigned int thread_count)
                     method->current_min_steps3 = 3*uint32_t(std::round(param.min_length/step_size_in_mm));
                 }
 
-                seed_index = rand(roi_mgr->seeds.size());
-                sub_voxel_shift = tipl::vector<3>(subvoxel_gen(seed),subvoxel_gen(seed),subvoxel_gen(seed));
+                seed_index = gen.rand(uint32_t(roi_mgr->seeds.size()));
+                sub_voxel_shift[0] = gen(-0.5f,0.5f);
+                sub_voxel_shift[1] = gen(-0.5f,0.5f);
+                sub_voxel_shift[2] = gen(-0.5f,0.5f);
                 if(param.max_length == param.min_length && method->trk->fib_num > 1)
-                    fiber_order = rand(method->trk->fib_num);
+                    fiber_order = gen.rand(method->trk->fib_num);
             }
 
             //initialize seeding
@@ -131,10 +134,10 @@ void ThreadData::run_thread(unsigned int thread_id,unsigned int thread_count)
             const float* end = result+point_count+point_count+point_count;
 
             ++tract_count[thread_id];
-            if(buffer_switch)
-                track_buffer_front[thread_id].push_back(std::vector<float>(result,end));
-            else
-                track_buffer_back[thread_id].push_back(std::vector<float>(result,end));
+            bool front = buffer_switch;
+            (front ? track_buffer_front : track_buffer_back)[thread_id].push_back(result,end);
+            if(record_cluster)
+                (front ? cluster_buffer_front : cluster_buffer_back)[thread_id].push_back(method->nearest_cluster);
         }
     }
     catch(...)
@@ -145,19 +148,25 @@ void ThreadData::run_thread(unsigned int thread_id,unsigned int thread_count)
     end_time = std::chrono::high_resolution_clock::now();
 }
 
-bool ThreadData::fetchTracks(TractModel* handle)
+bool ThreadData::fetchTracks(TractModel* handle,std::vector<unsigned int>* nearest_cluster)
 {
     bool has_track = false;
     if(handle->parameter_id.empty())
         handle->parameter_id = param.get_code();
     auto& buffer_at_rest = buffer_switch ? track_buffer_back : track_buffer_front;
-    for(auto& tract_per_thread : buffer_at_rest)
-        if(!tract_per_thread.empty())
+    auto& cluster_at_rest = buffer_switch ? cluster_buffer_back : cluster_buffer_front;
+    for(size_t i = 0;i < buffer_at_rest.size();++i)
+    {
+        if(!buffer_at_rest[i].empty())
         {
-            handle->add_tracts(tract_per_thread);
-            tract_per_thread.clear();
+            handle->add_tracts(buffer_at_rest[i]);
+            buffer_at_rest[i].clear();
             has_track = true;
         }
+        if(nearest_cluster)
+            nearest_cluster->insert(nearest_cluster->end(),cluster_at_rest[i].begin(),cluster_at_rest[i].end());
+        cluster_at_rest[i].clear();
+    }
     buffer_switch = !buffer_switch;
     return has_track;
 }
@@ -167,6 +176,8 @@ void ThreadData::run(unsigned int thread_count,
 {
     std::shared_ptr<tracking_data> trk_(new tracking_data);
     trk_->read(roi_mgr->handle);
+    if(trk_->dt_fa.empty())
+        trk_->packed_fibers = roi_mgr->handle->dir.get_fiber_pack();
     run(trk_,thread_count,wait);
 }
 
@@ -221,6 +232,8 @@ void ThreadData::run(std::shared_ptr<tracking_data> trk_,unsigned int thread_cou
     {
         track_buffer_back.resize(thread_count);
         track_buffer_front.resize(thread_count);
+        cluster_buffer_back.resize(thread_count);
+        cluster_buffer_front.resize(thread_count);
     }
     for (unsigned int index = 0;index < thread_count-1;++index)
         threads.push_back(std::thread([=](){run_thread(index,thread_count);}));
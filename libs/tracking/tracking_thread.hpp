@@ -4,6 +4,7 @@
 #include <ctime>
 #include <random>
 #include <memory>
+#include <atomic>
 
 #include "roi.hpp"
 #include "tracking_method.hpp"
@@ -15,13 +16,31 @@
 struct ThreadData
 {
 private:
-    std::mt19937 seed;
-    std::uniform_real_distribution<float> rand_gen,subvoxel_gen,angle_gen,angle_gen2,smoothing_gen,step_gen,step_gen2,threshold_gen;
-    template<typename T>
-    T rand(T size)
+    // counter-based generator: the n-th draw of a seed depends only on
+    // (random_seed,seed_number,n), so threads need no lock and the seed
+    // sequence does not depend on the thread count
+    struct seed_generator
     {
-        return std::min<T>(size-1,T(rand_gen(seed)*float(size)));
-    }
+        uint64_t key,counter;
+        seed_generator(uint64_t random_seed,uint64_t seed_number):
+            key(mix(random_seed+0x9E3779B97F4A7C15ull)),counter(seed_number << 4){}
+        static uint64_t mix(uint64_t z)
+        {
+            z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27))*0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+        float operator()(float from,float to)
+        {
+            return from+(to-from)*float(mix(key ^ mix(++counter)) >> 40)*(1.0f/16777216.0f);
+        }
+        template<typename T>
+        T rand(T size)
+        {
+            return std::min<T>(size-1,T((*this)(0.0f,1.0f)*float(size)));
+        }
+    };
+    std::atomic<uint64_t> seed_number = 0;
 public:
     std::shared_ptr<tracking_data> trk;
     std::shared_ptr<RoiMgr> roi_mgr;
@@ -31,11 +50,7 @@ public:
     float fa_threshold1,fa_threshold2;// use only if fa_threshold=0
     bool ready_to_track = false;
 public:
-    ThreadData(std::shared_ptr<fib_data> handle):seed(0),
-        rand_gen(0.0f,1.0f),subvoxel_gen(-0.5f,0.5f),
-        angle_gen(float(45.0f*M_PI/180.0f),float(90.0f*M_PI/180.0f)),
-        smoothing_gen(0.0f,0.95f),step_gen(0.5f,1.5f),threshold_gen(0.0f,1.0f),
-        roi_mgr(new RoiMgr(handle)){}
+    ThreadData(std::shared_ptr<fib_data> handle):roi_mgr(new RoiMgr(handle)){}
     ~ThreadData(void)
     {
         end_thread();
@@ -45,7 +60,6 @@ public:
     std::vector<std::thread> threads;
     std::vector<unsigned int> seed_count,tract_count;
     std::vector<unsigned char> running;
-    std::mutex lock_seed_function;
     std::chrono::high_resolution_clock::time_point begin_time,end_time;
     unsigned int get_total_seed_count(void)const
     {
@@ -61,12 +75,14 @@ public:
     }
 public:
     bool buffer_switch = true;
-    std::vector<std::vector<std::vector<float> > > track_buffer_back,track_buffer_front;
+    std::vector<tract_arena> track_buffer_back,track_buffer_front;
+    // nearest atlas cluster of each buffered track when tracking multiple bundles
+    std::vector<std::vector<unsigned int> > cluster_buffer_back,cluster_buffer_front;
     void end_thread(void);
 
 public:
     void run_thread(unsigned int thread_id,unsigned int thread_count);
-    bool fetchTracks(TractModel* handle);
+    bool fetchTracks(TractModel* handle,std::vector<unsigned int>* nearest_cluster = nullptr);
     void run(std::shared_ptr<tracking_data> trk,unsigned int thread_count,bool wait);
     void run(unsigned int thread_count,bool wait);
 
@@ -30,17 +30,21 @@ TractCluster::TractCluster(const float* param):error_distance(param[3])
     dim[2] = fdim[2];
     w = dim[0];
     wh = dim[0]*dim[1];
-    voxel_connection.resize(dim.size());
-
 }
 
-void TractCluster::set_tract_labels(Cluster* from,Cluster* to)
+uint32_t TractCluster::find_root(uint32_t x)
 {
-    std::vector<unsigned int>::const_iterator iter = from->tracts.begin();
-    std::vector<unsigned int>::const_iterator end = from->tracts.end();
-    for (;iter != end;++iter)
-        tract_labels[*iter] = to;
-
+    // path halving: concurrent updates only shorten paths to the same root
+    while(true)
+    {
+        uint32_t p = parent[x].load(std::memory_order_relaxed);
+        if(p == x)
+            return x;
+        uint32_t gp = parent[p].load(std::memory_order_relaxed);
+        if(p != gp)
+            parent[x].compare_exchange_weak(p,gp,std::memory_order_relaxed);
+        x = gp;
+    }
 }
 
 int TractCluster::get_index(short x,short y,short z)
@@ -52,72 +56,35 @@ int TractCluster::get_index(short x,short y,short z)
     index += x;
     return index;
 }
-/**
-prerequisite:
-    tract_index1 > tract_index2
-*/
-void TractCluster::merge_tract(unsigned int tract_index1,unsigned int tract_index2)
+void TractCluster::merge_tract(uint32_t tract_index1,uint32_t tract_index2)
 {
-    if (tract_index1 == tract_index2)
-        return;
-    std::lock_guard<std::mutex> lock(lock_merge);
-    Cluster* cluster_index = tract_labels[tract_index1];
-    if (cluster_index == 0) // no cluster
+    while(true)
     {
-        cluster_index = tract_labels[tract_index2];
-        if (cluster_index == 0) // create a cluster for both
-        {
-            std::shared_ptr<Cluster> new_cluster_index(new Cluster);
-            new_cluster_index->index = clusters.size();
-            clusters.push_back(new_cluster_index);
-
-            new_cluster_index->tracts.push_back(tract_index2);
-            tract_labels[tract_index2] = new_cluster_index.get();
-            new_cluster_index->tracts.push_back(tract_index1);
-            tract_labels[tract_index1] = new_cluster_index.get();
+        tract_index1 = find_root(tract_index1);
+        tract_index2 = find_root(tract_index2);
+        if(tract_index1 == tract_index2)
             return;
-        }
-        else
-        {
-            cluster_index->tracts.push_back(tract_index1);
-            tract_labels[tract_index1] = cluster_index;
+        // always link the larger root to the smaller one so that no cycle can form
+        if(tract_index1 < tract_index2)
+            std::swap(tract_index1,tract_index2);
+        uint32_t expected = tract_index1;
+        if(parent[tract_index1].compare_exchange_strong(expected,tract_index2))
             return;
-        }
-    }
-    else
-    {
-        Cluster* another_cluster_index = tract_labels[tract_index2];
-        if (another_cluster_index == 0) // add tract2 to the cluster
-        {
-            cluster_index->tracts.push_back(tract_index2);
-            tract_labels[tract_index2] = cluster_index;
-            return;
-        }
-        if (another_cluster_index == cluster_index) // already in the same group
-            return;
-        // merge two clusters
-        if (another_cluster_index->tracts.size() > cluster_index->tracts.size())
-            std::swap(cluster_index,another_cluster_index);
-
-        cluster_index->tracts.resize(another_cluster_index->tracts.size()+cluster_index->tracts.size());
-        std::copy(another_cluster_index->tracts.begin(),another_cluster_index->tracts.end(),
-                  cluster_index->tracts.end()-another_cluster_index->tracts.size());
-
-        set_tract_labels(another_cluster_index,cluster_index);
-        clusters.back()->index = another_cluster_index->index;
-        clusters[another_cluster_index->index] = clusters.back();
-        clusters.pop_back();
-
     }
 }
 
 void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
 {
-    tract_labels.clear();
+    clusters.clear();
     tract_mid_voxels.clear();
     tract_end1.clear();
     tract_end2.clear();
-    tract_labels.resize(tracks.size());
+    {
+        std::vector<std::atomic<uint32_t> > new_parent(tracks.size());
+        parent.swap(new_parent);
+    }
+    for(uint32_t i = 0;i < tracks.size();++i)
+        parent[i] = i;
     tract_length.resize(tracks.size());
     tract_mid_voxels.resize(tracks.size());
     tract_end1.resize(tracks.size());
@@ -150,45 +117,79 @@ void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
         tract_mid_voxels[tract_index] = tipl::pixel_index<3>(p_mid[0],p_mid[1],p_mid[2],dim).index();
 
     });
-    // book keeping passing points
-    for(unsigned int tract_index = 0;tract_index < tracks.size();++tract_index)
+    // book keeping passing points: count, prefix sum, then fill
+    auto for_each_passing_voxel = [&](unsigned int tract_index,auto&& fun)
     {
-        voxel_connection[tract_mid_voxels[tract_index]].push_back(tract_index);
+        fun(size_t(tract_mid_voxels[tract_index]));
         tipl::for_each_connected_neighbors(
                     tipl::pixel_index<3>(tract_mid_voxels[tract_index],dim),dim,
                     [&](const auto& pos)
             {
-                voxel_connection[pos.index()].push_back(tract_index);
+                fun(pos.index());
             });
-    }
-    tipl::adaptive_par_for(voxel_connection.size(),[&](unsigned int pos)
+    };
     {
-        std::set<unsigned int> tmp(voxel_connection[pos].begin(),voxel_connection[pos].end());
-        voxel_connection[pos] = std::vector<unsigned int>(tmp.begin(),tmp.end());
-    });
+        std::vector<std::atomic<uint32_t> > voxel_count(dim.size()+1);
+        tipl::adaptive_par_for(tracks.size(),[&](unsigned int tract_index)
+        {
+            for_each_passing_voxel(tract_index,[&](size_t pos){voxel_count[pos+1].fetch_add(1,std::memory_order_relaxed);});
+        });
+        voxel_pos.resize(dim.size()+1);
+        voxel_pos[0] = 0;
+        for(size_t pos = 1;pos < voxel_pos.size();++pos)
+            voxel_pos[pos] = voxel_pos[pos-1]+voxel_count[pos].load(std::memory_order_relaxed);
+        for(size_t pos = 0;pos < dim.size();++pos)
+            voxel_count[pos] = voxel_pos[pos];
+        voxel_tracts.resize(voxel_pos.back());
+        tipl::adaptive_par_for(tracks.size(),[&](unsigned int tract_index)
+        {
+            for_each_passing_voxel(tract_index,[&](size_t pos){voxel_tracts[voxel_count[pos].fetch_add(1,std::memory_order_relaxed)] = tract_index;});
+        });
+        tipl::adaptive_par_for(dim.size(),[&](size_t pos)
+        {
+            std::sort(voxel_tracts.begin()+voxel_pos[pos],voxel_tracts.begin()+voxel_pos[pos+1]);
+        });
+    }
     tipl::adaptive_par_for(tracks.size(),[&](unsigned int tract_index)
     {
         if(tracks[tract_index].empty())
             return;
-        auto& passing_tracts = voxel_connection[tract_mid_voxels[tract_index]];
+        auto voxel = tract_mid_voxels[tract_index];
         // check each tract to see if anyone is included in the error range
-        for (size_t i = 0;i < passing_tracts.size();++i)
+        for (size_t i = voxel_pos[voxel];i < voxel_pos[voxel+1];++i)
         {
-            unsigned int cur_index = passing_tracts[i];
+            unsigned int cur_index = voxel_tracts[i];
             if(cur_index <= tract_index)
                 continue;
-            Cluster* label1 = tract_labels[tract_index];
-            Cluster* label2 = tract_labels[cur_index];
-            if (label1 != nullptr && label1 == label2)
-                continue;
-
             if(std::fabs(tract_end1[tract_index][0]-tract_end1[cur_index][0]) > error_distance ||
                (tract_end1[tract_index]-tract_end1[cur_index]).length() > double(error_distance) ||
                (tract_end2[tract_index]-tract_end2[cur_index]).length() > double(error_distance))
                 continue;
             if (std::fabs((tract_length[cur_index]-tract_length[tract_index])) > double(error_distance)*2.0)
                 continue;
+            if(find_root(tract_index) == find_root(cur_index))
+                continue;
             merge_tract(tract_index,cur_index);
         }
     });
+
+    // materialize clusters with two or more tracts
+    std::vector<uint32_t> set_size(tracks.size());
+    for(uint32_t i = 0;i < tracks.size();++i)
+        ++set_size[find_root(i)];
+    std::vector<Cluster*> root_cluster(tracks.size());
+    for(uint32_t i = 0;i < tracks.size();++i)
+    {
+        auto root = find_root(i);
+        if(set_size[root] < 2)
+            continue;
+        if(!root_cluster[root])
+        {
+            clusters.push_back(std::make_shared<Cluster>());
+            clusters.back()->index = uint32_t(clusters.size()-1);
+            clusters.back()->tracts.reserve(set_size[root]);
+            root_cluster[root] = clusters.back().get();
+        }
+        root_cluster[root]->tracts.push_back(i);
+    }
 }
@@ -2,6 +2,7 @@
 #define TRACT_CLUSTER_HPP
 #include <vector>
 #include <map>
+#include <atomic>
 #include "zlib.h"
 #include "TIPL/tipl.hpp"
 
@@ -91,17 +92,16 @@ class TractCluster : public BasicCluster
     tipl::shape<3> dim;
     unsigned int w,wh;
     float error_distance;
-    std::mutex  lock_merge;
 private:
-
-
-    void set_tract_labels(Cluster* from,Cluster* to);
-    void merge_tract(unsigned int tract_index1,unsigned int tract_index2);
+    // disjoint set over tracts, a root always has the smallest index of its set
+    std::vector<std::atomic<uint32_t> > parent;
+    uint32_t find_root(uint32_t x);
+    void merge_tract(uint32_t tract_index1,uint32_t tract_index2);
     int get_index(short x,short y,short z);
 private:
-    std::vector<std::vector<unsigned int> > voxel_connection;
+    // tracts passing each voxel stored in CSR order
+    std::vector<uint32_t> voxel_pos,voxel_tracts;
 private:
-    std::vector<Cluster*> tract_labels;// 0 is no cluster
     std::vector<unsigned int> tract_mid_voxels;
     std::vector<tipl::vector<3> > tract_end1;
     std::vector<tipl::vector<3> > tract_end2;
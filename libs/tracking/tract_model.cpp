@@ -5,9 +5,9 @@
 #include <fstream>
 #include <sstream>
 #include <array>
+#include <atomic>
 #include <iterator>
 #include <tuple>
-#include <unordered_set>
 #include <map>
 #include <cmath>
 #include "roi.hpp"
@@ -60,198 +60,329 @@ class TinyTrack{
         int32_t z;
         } h;
     };
-
-    public:
-    static bool save_to_file(const char* file_name,
-                             tipl::shape<3> geo,
-                             tipl::vector<3> vs,
-                             const tipl::matrix<4,4>& trans_to_mni,
-                             const std::vector<std::vector<float> >& tract_data,
-                             const std::vector<uint16_t>& cluster,
-                             const std::string& report,
-                             const std::string& parameter_id,
-                             const std::vector<unsigned int>& color)
-    {
-        tipl::progress prog0("saving ",std::filesystem::path(file_name).filename().u8string().c_str());
-        tipl::io::gz_mat_write out(file_name);
-        if (!out)
-            return false;
-        out.write("dimension",geo);
-        out.write("voxel_size",vs);
-        out.write("trans_to_mni",trans_to_mni);
-        out.write("report",report);
-        out.write("parameter_id",parameter_id);
-        out.write("color",color);
-        out.write("cluster",cluster);
-        std::vector<std::vector<int32_t> > track32(tract_data.size());
-        std::vector<size_t> buf_size(track32.size());
-
+    static constexpr size_t block_size = 134217728; // 128 mb
+    static void encode(const std::vector<float>& tract,std::vector<int32_t>& t32)
+    {
+        t32.resize(tract.size());
+        // all coordinates multiply by 32 and convert to integer
+        for(size_t j = 0;j < t32.size();j++)
+            t32[j] = int(std::round(std::ldexp(tract[j],5)));
+        // Calculate coordinate displacement, skipping the first coordinate
+        for(size_t j = t32.size()-1;j >= 3;j--)
+            t32[j] -= t32[j-3];
+
+        // check if there is a leap, skipping the first coordinate
+        bool has_leap = false;
+        for(size_t j = 3;j < t32.size();j++)
+            if(t32[j] < -127 || t32[j] > 127)
+            {
+                has_leap = true;
+                break;
+            }
+        // if there is a leap, interpolate it
+        if(has_leap)
         {
-            tipl::progress prog1("compressing trajectories");
-            size_t p = 0;
-            tipl::adaptive_par_for(track32.size(),[&](size_t i)
+            std::vector<int32_t> new_t32;
+            new_t32.reserve(t32.size());
+            for(size_t j = 0;j < t32.size();j += 3)
             {
-                prog1(p++,tract_data.size());
-                auto& t32 = track32[i];
-                t32.resize(tract_data[i].size());
-                // all coordinates multiply by 32 and convert to integer
-                for(size_t j = 0;j < t32.size();j++)
-                    t32[j] = int(std::round(std::ldexp(tract_data[i][j],5)));
-                // Calculate coordinate displacement, skipping the first coordinate
-                for(size_t j = t32.size()-1;j >= 3;j--)
-                    t32[j] -= t32[j-3];
-
-                // check if there is a leap, skipping the first coordinate
-                bool has_leap = false;
-                for(size_t j = 3;j < t32.size();j++)
-                    if(t32[j] < -127 || t32[j] > 127)
-                    {
-                        has_leap = true;
-                        break;
-                    }
-                // if there is a leap, interpolate it
-                if(has_leap)
+                int32_t x = t32[j];
+                int32_t y = t32[j+1];
+                int32_t z = t32[j+2];
+                bool interpolated = false;
+                while(j && (x < -127 || x > 127 || y < -127 || y > 127 || z < -127 || z > 127))
                 {
-                    std::vector<int32_t> new_t32;
-                    new_t32.reserve(t32.size());
-                    for(size_t j = 0;j < t32.size();j += 3)
-                    {
-                        int32_t x = t32[j];
-                        int32_t y = t32[j+1];
-                        int32_t z = t32[j+2];
-                        bool interpolated = false;
-                        while(j && (x < -127 || x > 127 || y < -127 || y > 127 || z < -127 || z > 127))
-                        {
-                            x /= 2;
-                            y /= 2;
-                            z /= 2;
-                            interpolated = true;
-                        }
-                        if(interpolated)
-                        {
-                            t32[j] -= x;
-                            t32[j+1] -= y;
-                            t32[j+2] -= z;
-                            j -= 3;
-                        }
-                        new_t32.push_back(x);
-                        new_t32.push_back(y);
-                        new_t32.push_back(z);
-                    }
-                    new_t32.swap(t32);
+                    x /= 2;
+                    y /= 2;
+                    z /= 2;
+                    interpolated = true;
                 }
-                buf_size[i] = sizeof(tract_header)+t32.size()-3;
-            });
-            if(prog1.aborted())
-                return false;
+                if(interpolated)
+                {
+                    t32[j] -= x;
+                    t32[j+1] -= y;
+                    t32[j+2] -= z;
+                    j -= 3;
+                }
+                new_t32.push_back(x);
+                new_t32.push_back(y);
+                new_t32.push_back(z);
+            }
+            new_t32.swap(t32);
+        }
+    }
+    static void decode(const char* track_buf,size_t buf_size,size_t pos,std::vector<float>& cur_tract)
+    {
+        tract_header hr;
+        std::copy(&track_buf[pos],&track_buf[pos]+16,hr.buf);
+        if(hr.h.count > buf_size)
+            return;
+        cur_tract.resize(hr.h.count);
+        cur_tract[0] = hr.h.x;
+        cur_tract[1] = hr.h.y;
+        cur_tract[2] = hr.h.z;
+        size_t shift = pos+sizeof(tract_header)-3;
+        for(size_t j = 3;j < cur_tract.size();++j)
+            cur_tract[j] = (cur_tract[j-3] + track_buf[shift+j]);
+        for(size_t j = 0;j < cur_tract.size();++j)
+            cur_tract[j] = std::ldexp(cur_tract[j],-5);
+    }
+    static void get_tract_pos(const char* track_buf,size_t buf_size,std::vector<size_t>& pos)
+    {
+        pos.clear();
+        for(size_t i = 0;i < buf_size;)
+        {
+            pos.push_back(i);
+            i += *reinterpret_cast<const uint32_t*>(track_buf+i);
+            i += sizeof(tract_header)-3;
+        }
+    }
+    static std::string block_name(size_t block)
+    {
+        return block ? std::string("track")+std::to_string(block) : std::string("track");
+    }
+public:
+    // incremental writer: tracts are compressed and written in 128 mb blocks as they come
+    class writer{
+        tipl::io::gz_mat_write out;
+        std::vector<char> out_buf;
+        std::vector<uint32_t> block_tract_count;
+        uint32_t cur_tract_count = 0;
+        bool flush(void)
+        {
+            if(out_buf.empty())
+                return true;
+            out.write(block_name(block_tract_count.size()).c_str(),&out_buf[0],out_buf.size(),1);
+            block_tract_count.push_back(cur_tract_count);
+            out_buf.clear();
+            cur_tract_count = 0;
+            return !(!out);
+        }
+    public:
+        writer(const char* file_name):out(file_name){}
+        bool operator!(void) const{return !out;}
+        bool write_header(tipl::shape<3> geo,tipl::vector<3> vs,const tipl::matrix<4,4>& trans_to_mni,
+                          const std::string& report,const std::string& parameter_id)
+        {
+            out.write("dimension",geo);
+            out.write("voxel_size",vs);
+            out.write("trans_to_mni",trans_to_mni);
+            out.write("report",report);
+            out.write("parameter_id",parameter_id);
+            return !(!out);
         }
+        bool add_tracts(const std::vector<std::vector<float> >& tract_data,size_t begin,size_t end)
         {
-            for(size_t block = 0,cur_track_block = 0;prog0(cur_track_block,track32.size());++block)
+            // compress a bounded batch at a time to limit memory
+            const size_t batch_size = 65536;
+            std::vector<std::vector<int32_t> > track32;
+            for(size_t from = begin;from < end;from += batch_size)
             {
-                // record write position for each track
-                size_t total_size = 0;
-                std::vector<size_t> pos;
-                for(size_t i = cur_track_block;i < track32.size();++i)
+                size_t to = std::min<size_t>(end,from+batch_size);
+                track32.resize(to-from);
+                tipl::adaptive_par_for(track32.size(),[&](size_t i)
                 {
-                    pos.push_back(total_size);
-                    total_size += buf_size[i];
-                    if(total_size > 134217728) // 128 mb
-                        break;
-                }
-
-                std::vector<char> out_buf(total_size);
-                tipl::adaptive_par_for(pos.size(),[&](size_t i)
+                    encode(tract_data[from+i],track32[i]);
+                });
+                for(const auto& t32 : track32)
                 {
-                    auto& t32 = track32[cur_track_block+i];
-                    auto out = &out_buf[pos[i]];
+                    size_t pos = out_buf.size();
+                    out_buf.resize(pos+sizeof(tract_header)+t32.size()-3);
+                    auto out_ptr = &out_buf[pos];
                     tract_header hr;
                     hr.h.count = uint32_t(t32.size());
                     hr.h.x = t32[0];
                     hr.h.y = t32[1];
                     hr.h.z = t32[2];
-                    std::copy(hr.buf,hr.buf+16,out);
-                    out += sizeof(tract_header)-3;
+                    std::copy(hr.buf,hr.buf+16,out_ptr);
+                    out_ptr += sizeof(tract_header)-3;
                     for(size_t j = 3;j < t32.size();j++)
-                        out[j] = char(t32[j]);
-                });
-
-                if(block == 0)
-                    out.write("track",&out_buf[0],total_size,1);
-                else
-                    out.write((std::string("track")+std::to_string(block)).c_str(),&out_buf[0],total_size,1);
-                cur_track_block += pos.size();
+                        out_ptr[j] = char(t32[j]);
+                    ++cur_tract_count;
+                    if(out_buf.size() > block_size && !flush())
+                        return false;
+                }
             }
+            return true;
         }
-        return !prog0.aborted();
-    }
-    static bool load_from_file(const char* file_name,
-                               std::vector<std::vector<float> >& tract_data,
-                               std::vector<uint16_t>& tract_cluster,
-                               tipl::shape<3>& geo,tipl::vector<3>& vs,
-                               tipl::matrix<4,4>& trans_to_mni,
-                               std::string& report,std::string& parameter_id,
-                               std::vector<unsigned int>& color)
-    {
-        tipl::progress prog("opening ",std::filesystem::path(file_name).filename().string());
+        bool close(const std::vector<uint16_t>& cluster,const std::vector<unsigned int>& color)
+        {
+            if(!flush())
+                return false;
+            out.write("color",color);
+            out.write("cluster",cluster);
+            // number of tracts in each block for random access
+            out.write("track_block",block_tract_count);
+            return !(!out);
+        }
+    };
+    // block reader: decodes one block at a time and releases its buffer afterward
+    class reader{
+        std::string file_name;
         tipl::io::gz_mat_read in;
-        prepare_idx(file_name,in.in);
-        if (!in.load_from_file(file_name))
-            return false;
-        in.read("dimension",geo);
-        in.read("voxel_size",vs);
-        in.read("trans_to_mni",trans_to_mni);
-        in.read("report",report);
-        in.read("parameter_id",parameter_id);
-        color = in.read_as_vector<unsigned int>("color");
-        tract_cluster = in.read_as_vector<uint16_t>("cluster");
-        unsigned int row,col;
-        for(unsigned int block = 0;1;block++)
+        std::vector<size_t> block_pos; // first tract index of each block
+        bool loaded = false;
+    public:
+        tipl::shape<3> geo;
+        tipl::vector<3> vs;
+        tipl::matrix<4,4> trans_to_mni;
+        std::string report,parameter_id;
+        std::vector<unsigned int> color;
+        std::vector<uint16_t> cluster;
+    public:
+        ~reader(void)
         {
-            const char* track_buf = nullptr;
-            if(block == 0)
+            if(loaded)
+                save_idx(file_name,in.in);
+        }
+        bool open(const char* file_name_)
+        {
+            file_name = file_name_;
+            prepare_idx(file_name,in.in);
+            if(in.in->has_access_points())
             {
-                if(!in.read("track",row,col,track_buf))
-                    return false;
+                in.delay_read = true;
+                in.in->buffer_all = false;
             }
-            else
+            if (!in.load_from_file(file_name_) || !in.has("track"))
+                return false;
+            in.read("dimension",geo);
+            in.read("voxel_size",vs);
+            in.read("trans_to_mni",trans_to_mni);
+            in.read("report",report);
+            in.read("parameter_id",parameter_id);
+            color = in.read_as_vector<unsigned int>("color");
+            cluster = in.read_as_vector<uint16_t>("cluster");
+            auto count = in.read_as_vector<uint32_t>("track_block");
+            size_t block_count = 0;
+            while(in.has(block_name(block_count).c_str()))
+                ++block_count;
+            if(count.size() == block_count)
             {
-                auto name = std::string("track")+std::to_string(block);
-                if(!in.has(name.c_str()))
-                    break;
-                if(!in.read(name.c_str(),row,col,track_buf))
-                    return false;
+                block_pos.resize(block_count+1);
+                block_pos[0] = 0;
+                for(size_t i = 0;i < block_count;++i)
+                    block_pos[i+1] = block_pos[i]+count[i];
             }
+            else
+                block_pos.resize(block_count+1,0); // files without a block index
+            loaded = true;
+            return true;
+        }
+        size_t block_count(void) const{return block_pos.size()-1;}
+        // the block index is only available for files written with track_block
+        bool has_block_index(void) const{return block_pos.back() || block_count() == 0;}
+        size_t tract_count(void) const{return block_pos.back();}
+        bool read_block(size_t block,std::vector<std::vector<float> >& tract_data)
+        {
+            tract_data.clear();
+            auto name = block_name(block);
+            auto index = in.index_of(name);
+            if(index >= in.size())
+                return false;
+            if(in[index].has_delay_read() && !in[index].read(*(in.in.get())))
+                return false;
+            unsigned int row,col;
+            const char* track_buf = nullptr;
+            if(!in.read(name.c_str(),row,col,track_buf))
+                return false;
             size_t buf_size = size_t(row)*size_t(col);
             std::vector<size_t> pos;
-            for(size_t i = 0;i < buf_size;)
-            {
-                pos.push_back(i);
-                i += *reinterpret_cast<const uint32_t*>(track_buf+i);
-                i += sizeof(tract_header)-3;
-            }
-            size_t add_tract_index = tract_data.size();
-            tract_data.resize(add_tract_index+pos.size());
+            get_tract_pos(track_buf,buf_size,pos);
+            tract_data.resize(pos.size());
             tipl::adaptive_par_for(pos.size(),[&](size_t i)
             {
-                auto& cur_tract = tract_data[i+add_tract_index];
-                tract_header hr;
-                std::copy(&track_buf[pos[i]],&track_buf[pos[i]]+16,hr.buf);
-                if(hr.h.count > buf_size)
-                    return;
-                cur_tract.resize(hr.h.count);
-                cur_tract[0] = hr.h.x;
-                cur_tract[1] = hr.h.y;
-                cur_tract[2] = hr.h.z;
-                size_t shift = pos[i]+sizeof(tract_header)-3;
-                for(size_t j = 3;j < cur_tract.size();++j)
-                    cur_tract[j] = (cur_tract[j-3] + track_buf[shift+j]);
-                for(size_t j = 0;j < cur_tract.size();++j)
-                    cur_tract[j] = std::ldexp(cur_tract[j],-5);
+                decode(track_buf,buf_size,pos[i],tract_data[i]);
             });
+            in.remove(name);
+            return true;
         }
-
-        save_idx(file_name,in.in);
-        return true;
+        // read tracts [from,to) without decoding blocks outside the range
+        bool read_range(size_t from,size_t to,std::vector<std::vector<float> >& tract_data)
+        {
+            tract_data.clear();
+            if(!has_block_index())
+                return false;
+            std::vector<std::vector<float> > block_data;
+            for(size_t block = 0;block < block_count() && block_pos[block] < to;++block)
+            {
+                if(block_pos[block+1] <= from)
+                    continue;
+                if(!read_block(block,block_data))
+                    return false;
+                size_t b = std::max<size_t>(from,block_pos[block])-block_pos[block];
+                size_t e = std::min<size_t>(to,block_pos[block+1])-block_pos[block];
+                std::move(block_data.begin()+b,block_data.begin()+e,std::back_inserter(tract_data));
+            }
+            return true;
+        }
+    };
+    static bool save_to_file(const char* file_name,
+                             tipl::shape<3> geo,
+                             tipl::vector<3> vs,
+                             const tipl::matrix<4,4>& trans_to_mni,
+                             const std::vector<std::vector<float> >& tract_data,
+                             const std::vector<uint16_t>& cluster,
+                             const std::string& report,
+                             const std::string& parameter_id,
+                             const std::vector<unsigned int>& color)
+    {
+        tipl::progress prog0("saving ",std::filesystem::path(file_name).filename().u8string().c_str());
+        writer out(file_name);
+        if (!out || !out.write_header(geo,vs,trans_to_mni,report,parameter_id))
+            return false;
+        const size_t chunk_size = 1048576;
+        for(size_t from = 0;prog0(from,tract_data.size());from += chunk_size)
+            if(!out.add_tracts(tract_data,from,std::min<size_t>(tract_data.size(),from+chunk_size)))
+                return false;
+        if(prog0.aborted())
+            return false;
+        return out.close(cluster,color);
+    }
+    static bool load_from_file(const char* file_name,
+                               std::vector<std::vector<float> >& tract_data,
+                               std::vector<uint16_t>& tract_cluster,
+                               tipl::shape<3>& geo,tipl::vector<3>& vs,
+                               tipl::matrix<4,4>& trans_to_mni,
+                               std::string& report,std::string& parameter_id,
+                               std::vector<unsigned int>& color,
+                               size_t from = 0,size_t to = SIZE_MAX)
+    {
+        tipl::progress prog("opening ",std::filesystem::path(file_name).filename().string());
+        reader in;
+        if (!in.open(file_name))
+            return false;
+        geo = in.geo;
+        vs = in.vs;
+        trans_to_mni = in.trans_to_mni;
+        report = in.report;
+        parameter_id = in.parameter_id;
+        color.swap(in.color);
+        tract_cluster.swap(in.cluster);
+        // only decode the blocks covering the range
+        if((from || to < in.tract_count()) && in.has_block_index())
+        {
+            to = std::min<size_t>(to,in.tract_count());
+            if(from >= to)
+                return false;
+            std::vector<std::vector<float> > range_data;
+            if(!in.read_range(from,to,range_data))
+                return false;
+            std::move(range_data.begin(),range_data.end(),std::back_inserter(tract_data));
+            if(tract_cluster.size() == in.tract_count())
+                tract_cluster = std::vector<uint16_t>(tract_cluster.begin()+int64_t(from),tract_cluster.begin()+int64_t(to));
+            return true;
+        }
+        if(in.has_block_index())
+            tract_data.reserve(tract_data.size()+in.tract_count());
+        std::vector<std::vector<float> > block_data;
+        for(size_t block = 0;prog(block,in.block_count());++block)
+        {
+            if(!in.read_block(block,block_data))
+                return false;
+            std::move(block_data.begin(),block_data.end(),std::back_inserter(tract_data));
+        }
+        return !prog.aborted();
     }
 };
 
@@ -621,59 +752,70 @@ void TractModel::add(const TractModel& rhs)
 template<>
 bool dual_reg<3>::apply_warping_tt(const char* from,const char* to) const
 {
+    TinyTrack::reader in;
+    if(!in.open(from))
+    {
+        error_msg = "Failed to read file";
+        return false;
+    }
+    tipl::out() << "image dim:" << Is;
+    tipl::out() << "image trans:" << IR;
+    tipl::out() << "tract dim:" << in.geo;
+    tipl::out() << "tract trans:" << in.trans_to_mni;
+    if(in.geo != Is || in.trans_to_mni != IR)
+    {
+        error_msg = "tracts are not in the image space";
+        return false;
+    }
+    tipl::out() << "saving " << to;
+    TinyTrack::writer out(to);
+    if(!out || !out.write_header(to2from.shape(),Itvs,ItR,in.report,in.parameter_id))
+    {
+        error_msg = "Failed to save file";
+        return false;
+    }
+    tipl::vector<3> max_pos(from2to.shape());
+    max_pos -= 1.0f;
+    auto T = tipl::from_space(ItR).to(IR);
+    // warp one block at a time to keep memory bounded
     std::vector<std::vector<float> > loaded_tract_data;
-    std::vector<uint16_t> cluster;
-    std::vector<unsigned int> color;
-    std::string report, parameter_id;
-
+    for(size_t block = 0;block < in.block_count();++block)
     {
-        tipl::shape<3> geo;
-        tipl::vector<3> vs;
-        tipl::matrix<4,4,float> trans_to_mni;
-        if(!TinyTrack::load_from_file(from,loaded_tract_data,cluster,geo,vs,trans_to_mni,report,parameter_id,color))
+        if(!in.read_block(block,loaded_tract_data))
         {
             error_msg = "Failed to read file";
             return false;
         }
-
-        tipl::out() << "image dim:" << Is;
-        tipl::out() << "image trans:" << IR;
-        tipl::out() << "tract dim:" << geo;
-        tipl::out() << "tract trans:" << trans_to_mni;
-        if(geo != Is || trans_to_mni != IR)
+        tipl::adaptive_par_for(loaded_tract_data.size(),[&](size_t i)
         {
-            error_msg = "tracts are not in the image space";
+            for(size_t j = 0;j < loaded_tract_data[i].size();j += 3)
+            {
+                tipl::vector<3> pos(&loaded_tract_data[i][j]);
+                pos.to(T);
+                pos[0] = std::min<float>(std::max<float>(pos[0],0.0f),max_pos[0]);
+                pos[1] = std::min<float>(std::max<float>(pos[1],0.0f),max_pos[1]);
+                pos[2] = std::min<float>(std::max<float>(pos[2],0.0f),max_pos[2]);
+                tipl::vector<3> new_pos;
+                tipl::estimate(from2to,pos,new_pos);
+                loaded_tract_data[i][j] = new_pos[0];
+                loaded_tract_data[i][j+1] = new_pos[1];
+                loaded_tract_data[i][j+2] = new_pos[2];
+            }
+        });
+        if(!out.add_tracts(loaded_tract_data,0,loaded_tract_data.size()))
+        {
+            error_msg = "Failed to save file";
             return false;
         }
     }
-    tipl::vector<3> max_pos(from2to.shape());
-    max_pos -= 1.0f;
-    auto T = tipl::from_space(ItR).to(IR);
-    tipl::adaptive_par_for(loaded_tract_data.size(),[&](size_t i)
-    {
-        for(size_t j = 0;j < loaded_tract_data[i].size();j += 3)
-        {
-            tipl::vector<3> pos(&loaded_tract_data[i][j]);
-            pos.to(T);
-            pos[0] = std::min<float>(std::max<float>(pos[0],0.0f),max_pos[0]);
-            pos[1] = std::min<float>(std::max<float>(pos[1],0.0f),max_pos[1]);
-            pos[2] = std::min<float>(std::max<float>(pos[2],0.0f),max_pos[2]);
-            tipl::vector<3> new_pos;
-            tipl::estimate(from2to,pos,new_pos);
-            loaded_tract_data[i][j] = new_pos[0];
-            loaded_tract_data[i][j+1] = new_pos[1];
-            loaded_tract_data[i][j+2] = new_pos[2];
-        }
-    });
-    tipl::out() << "saving " << to;
-    if(!TinyTrack::save_to_file(to,to2from.shape(),Itvs,ItR,loaded_tract_data,cluster,report,parameter_id,color))
+    if(!out.close(in.cluster,in.color))
     {
         error_msg = "Failed to save file";
         return false;
     }
     return true;
 }
-bool TractModel::load_tracts_from_file(const char* file_name_,fib_data* handle,bool tract_is_mni)
+bool TractModel::load_tracts_from_file(const char* file_name_,fib_data* handle,bool tract_is_mni,size_t from,size_t to)
 {
     std::string file_name(file_name_);
     std::vector<std::vector<float> > loaded_tract_data;
@@ -693,8 +835,10 @@ bool TractModel::load_tracts_from_file(const char* file_name_,fib_data* handle,b
     {
         unsigned int old_color = color;
         std::vector<uint16_t> cluster;
-        if(!TinyTrack::load_from_file(file_name_,loaded_tract_data,cluster,geo,vs,source_trans_to_mni,report,parameter_id,colors))
+        if(!TinyTrack::load_from_file(file_name_,loaded_tract_data,cluster,geo,vs,source_trans_to_mni,report,parameter_id,colors,from,to))
             return false;
+        from = 0;
+        to = SIZE_MAX;
         if(geo == handle->dim && vs == handle->vs && !tract_is_mni && source_trans_to_mni != handle->trans_to_mni)
         {
             tipl::out() << "identical dimension: overwriting tractography transformation matrix." << std::endl;
@@ -784,6 +928,17 @@ bool TractModel::load_tracts_from_file(const char* file_name_,fib_data* handle,b
 
 
 
+    // formats other than tt.gz are read whole and then cut to the range
+    if(from || to < loaded_tract_data.size())
+    {
+        to = std::min<size_t>(to,loaded_tract_data.size());
+        if(from >= to)
+            return false;
+        if(loaded_tract_cluster.size() == loaded_tract_data.size())
+            loaded_tract_cluster = std::vector<unsigned int>(loaded_tract_cluster.begin()+int64_t(from),loaded_tract_cluster.begin()+int64_t(to));
+        loaded_tract_data.erase(loaded_tract_data.begin()+int64_t(to),loaded_tract_data.end());
+        loaded_tract_data.erase(loaded_tract_data.begin(),loaded_tract_data.begin()+int64_t(from));
+    }
     if (loaded_tract_data.empty())
         return false;
     if(loaded_tract_cluster.size() == loaded_tract_data.size())
@@ -1658,29 +1813,18 @@ bool TractModel::select_tracts(const std::vector<unsigned int>& tracts_to_select
 }
 //---------------------------------------------------------------------------
 bool TractModel::delete_repeated(float d)
-{   
-    std::vector<std::vector<size_t> > x_reg;
-    std::vector<size_t> track_reg;
-    if(tract_data.size() > 50000)
-    {
-        x_reg.resize(geo.plane_size());
-        track_reg.resize(tract_data.size());
-        for(size_t i = 0; i < tract_data.size();++i)
+{
+    if(d <= 0.0f || tract_data.size() < 2)
+        return false;
+    // index both end points so that reversed tracts are also compared
+    tract_end_grid grid;
+    grid.clear(d);
+    for(size_t i = 0;i < tract_data.size();++i)
+        if(!tract_data[i].empty())
         {
-            int x = int(std::round(tract_data[i][0]));
-            int y = int(std::round(tract_data[i][1]));
-            if(x < 0)
-                x = 0;
-            if(y < 0)
-                y = 0;
-            if(x >= geo[0])
-                x = geo[0]-1;
-            if(y >= geo[1])
-                y = geo[1]-1;
-            x_reg[track_reg[i] = size_t(x + y*geo[0])].push_back(i);
+            grid.add(&tract_data[i][0],uint32_t(i));
+            grid.add(&tract_data[i][tract_data[i].size()-3],uint32_t(i));
         }
-    }
-    auto norm1 = [](const float* v1,const float* v2){return std::fabs(v1[0]-v2[0])+std::fabs(v1[1]-v2[1])+std::fabs(v1[2]-v2[2]);};
     struct min_min{
         inline float operator()(float min_dis,const float* v1,const float* v2)
         {
@@ -1696,50 +1840,77 @@ bool TractModel::delete_repeated(float d)
             return d1;
         }
     }min_min_fun;
-    std::vector<bool> repeated(tract_data.size());
-    tipl::adaptive_par_for(tract_data.size(),[&](size_t i)
+    auto within = [&](const std::vector<float>& from,const std::vector<float>& to)
+    {
+        for(size_t m = 0;m < from.size();m += 3)
+            if(min_distance_to_tract(&from[m],&to[0],uint32_t(to.size()),
+                                     std::numeric_limits<float>::max(),d) > d)
+                return false;
+        return true;
+    };
+    // disjoint set over tracts merged as repeated pairs are found; a root always has the
+    // smallest index of its set, so the kept tract does not depend on thread scheduling
+    std::vector<std::atomic<uint32_t> > parent(tract_data.size());
+    for(size_t i = 0;i < parent.size();++i)
+        parent[i] = uint32_t(i);
+    auto find_root = [&](uint32_t x)
+    {
+        while(true)
+        {
+            uint32_t p = parent[x].load(std::memory_order_relaxed);
+            if(p == x)
+                return x;
+            uint32_t gp = parent[p].load(std::memory_order_relaxed);
+            if(p != gp)
+                parent[x].compare_exchange_weak(p,gp,std::memory_order_relaxed);
+            x = gp;
+        }
+    };
+    auto merge = [&](uint32_t i,uint32_t j)
     {
-        if(repeated[i])
+        while(true)
+        {
+            i = find_root(i);
+            j = find_root(j);
+            if(i == j)
+                return;
+            if(i < j)
+                std::swap(i,j);
+            uint32_t expected = i;
+            if(parent[i].compare_exchange_strong(expected,j))
+                return;
+        }
+    };
+    std::vector<std::vector<uint32_t> > candidates_threads(tipl::max_thread_count);
+    tipl::par_for<tipl::sequential_with_id>(tract_data.size(),[&](size_t i,unsigned int id)
+    {
+        const auto& ti = tract_data[i];
+        if(ti.empty())
             return;
-        size_t max_k = x_reg.empty() ? tract_data.size():x_reg[track_reg[i]].size();
-        for(size_t k = x_reg.empty() ? i+1:0;k < max_k;++k)
+        const float* i_end = &ti[ti.size()-3];
+        auto& candidates = candidates_threads[id];
+        grid.get_candidates(&ti[0],candidates);
+        candidates.erase(std::unique(candidates.begin(),candidates.end()),candidates.end());
+        for(auto j : candidates)
         {
-            size_t j = x_reg.empty() ? k :  x_reg[track_reg[i]][k];
-            if(j <= i || repeated[j] ||
-               min_min_fun(d,&tract_data[i][0],&tract_data[j][0]) >= d ||
-               min_min_fun(d,&tract_data[i][tract_data[i].size()-3],&tract_data[j][tract_data[j].size()-3]) >= d)
+            if(j <= i)
                 continue;
-            bool not_repeated = false;
-            for(size_t m = 0;m < tract_data[i].size();m += 3)
-            {
-                float min_dis = norm1(&tract_data[i][m],&tract_data[j][0]);
-                for(size_t n = 3;n < tract_data[j].size();n += 3)
-                    min_dis = min_min_fun(min_dis,&tract_data[i][m],&tract_data[j][n]);
-                if(min_dis > d)
-                {
-                    not_repeated = true;
-                    break;
-                }
-            }
-            if(!not_repeated)
-            for(size_t m = 0;m < tract_data[j].size();m += 3)
-            {
-                float min_dis = norm1(&tract_data[j][m],&tract_data[i][0]);
-                for(size_t n = 0;n < tract_data[i].size();n += 3)
-                    min_dis = min_min_fun(min_dis,&tract_data[j][m],&tract_data[i][n]);
-                if(min_dis > d)
-                {
-                    not_repeated = true;
-                    break;
-                }
-            }
-            if(!not_repeated)
-                repeated[j] = true;
+            const auto& tj = tract_data[j];
+            const float* j_end = &tj[tj.size()-3];
+            if((min_min_fun(d,&ti[0],&tj[0]) >= d || min_min_fun(d,i_end,j_end) >= d) &&
+               (min_min_fun(d,&ti[0],j_end) >= d || min_min_fun(d,i_end,&tj[0]) >= d))
+                continue;
+            // already in the same set through other repeated tracts
+            if(find_root(uint32_t(i)) == find_root(j))
+                continue;
+            if(within(ti,tj) && within(tj,ti))
+                merge(uint32_t(i),j);
         }
     });
+    // keep the first tract of each repeated group in the original order
     std::vector<unsigned int> track_to_delete;
     for(size_t i = 0;i < tract_data.size();++i)
-        if(repeated[i])
+        if(find_root(uint32_t(i)) != i)
             track_to_delete.push_back(uint32_t(i));
     return delete_tracts(track_to_delete);
 }
@@ -1964,10 +2135,12 @@ bool TractModel::cut_by_slice(unsigned int dim, unsigned int pos,bool greater,co
 bool TractModel::filter_by_roi(std::shared_ptr<RoiMgr> roi_mgr)
 {
     std::vector<unsigned int> tracts_to_delete;
+    std::vector<uint32_t> candidates;
+    unsigned int nearest_id;
     for (unsigned int index = 0;index < tract_data.size();++index)
     if(tract_data[index].size() >= 6)
     {
-        if(!roi_mgr->within_roi(&(tract_data[index][0]),tract_data[index].size()) ||
+        if(!roi_mgr->within_roi(&(tract_data[index][0]),tract_data[index].size(),candidates,nearest_id) ||
            !roi_mgr->fulfill_end_point(tipl::vector<3,float>(tract_data[index][0],
                                                              tract_data[index][1],
                                                              tract_data[index][2]),
@@ -2478,45 +2651,92 @@ void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract, unsigne
     }
     saved = false;
 }
+void TractModel::add_tracts(const tract_arena& new_tract)
+{
+    tipl::rgb color = tract_color.empty() ? default_tract_color : tipl::rgb(tract_color.back());
+    size_t old_size = tract_data.size();
+    tract_data.resize(old_size+new_tract.size());
+    tipl::adaptive_par_for(new_tract.size(),[&](size_t index)
+    {
+        tract_data[old_size+index].assign(new_tract.begin(index),new_tract.end(index));
+    });
+    tract_color.resize(tract_data.size(),color);
+    tract_tag.resize(tract_data.size(),0);
+    saved = false;
+}
+void TractModel::add_tracts(const tract_arena& new_tract, unsigned int length_threshold,tipl::rgb color)
+{
+    tract_data.reserve(tract_data.size()+new_tract.size());
+    for (size_t index = 0;index < new_tract.size();++index)
+    {
+        if (new_tract.tract_size(index)/3-1 < length_threshold)
+            continue;
+        tract_data.push_back(std::vector<float>(new_tract.begin(index),new_tract.end(index)));
+        tract_color.push_back(color);
+        tract_tag.push_back(0);
+    }
+    saved = false;
+}
 //---------------------------------------------------------------------------
+// a volume accumulated by all threads at once, so that memory stays at one
+// volume regardless of the thread count
+template<class T>
+class atomic_volume{
+    std::vector<std::atomic<T> > data;
+public:
+    atomic_volume(size_t size):data(size){}
+    void add(size_t index,T value)
+    {
+        auto& v = data[index];
+        if constexpr(std::is_integral_v<T>)
+            v.fetch_add(value,std::memory_order_relaxed);
+        else
+        {
+            T old = v.load(std::memory_order_relaxed);
+            while(!v.compare_exchange_weak(old,old+value,std::memory_order_relaxed))
+                ;
+        }
+    }
+    T operator[](size_t index) const{return data[index].load(std::memory_order_relaxed);}
+};
+// voxels passed by a tract, sorted and unique so that each tract counts once per voxel
+void get_tract_voxels(const std::vector<float>& tract,const tipl::shape<3>& s,
+                      const tipl::matrix<4,4>& to_t1t2,bool is_identity,bool endpoint,
+                      std::vector<size_t>& voxels)
+{
+    voxels.clear();
+    for (unsigned int j = 0;j < tract.size();j+=3)
+    {
+        if(j && endpoint)
+            j = uint32_t(tract.size())-3;
+        tipl::vector<3> pos(tract.data()+j);
+        if(!is_identity)
+            pos.to(to_t1t2);
+        pos.round();
+        tipl::vector<3,int> ipos(pos);
+        if (s.is_valid(ipos))
+            voxels.push_back(tipl::voxel2index(ipos.begin(),s));
+    }
+    std::sort(voxels.begin(),voxels.end());
+    voxels.erase(std::unique(voxels.begin(),voxels.end()),voxels.end());
+}
 void TractModel::get_density_map(tipl::image<3,unsigned int>& mapping,
                                  const tipl::matrix<4,4>& to_t1t2,bool endpoint)
 {
     tipl::shape<3> s(mapping.shape());
-    std::vector<tipl::image<3,unsigned int> > maps(std::thread::hardware_concurrency());
+    atomic_volume<unsigned int> count(s.size());
+    std::vector<std::vector<size_t> > voxels(std::thread::hardware_concurrency());
     bool is_identity = (to_t1t2 == tipl::matrix<4,4>(tipl::identity_matrix()));
     tipl::adaptive_par_for<tipl::sequential_with_id>(tract_data.size(),[&](unsigned int i,unsigned int id)
     {
-        auto& m = maps[id];
-        if(m.empty())
-            m.resize(s);
-        std::unordered_set<size_t> point_set;
-        const auto& tract = tract_data[i];
-        for (unsigned int j = 0;j < tract.size();j+=3)
-        {
-            if(j && endpoint)
-                j = uint32_t(tract.size())-3;
-            tipl::vector<3> pos(tract.data()+j);
-            if(!is_identity)
-                pos.to(to_t1t2);
-            pos.round();
-            tipl::vector<3,int> ipos(pos);
-            if (s.is_valid(ipos))
-                point_set.insert(tipl::voxel2index(ipos.begin(),mapping.shape()));
-        }
-        for(auto pos : point_set)
-            ++m[pos];
+        get_tract_voxels(tract_data[i],s,to_t1t2,is_identity,endpoint,voxels[id]);
+        for(auto pos : voxels[id])
+            count.add(pos,1);
     });
-
-    while(maps.back().empty() && !maps.empty())
-        maps.pop_back();
-
-    tipl::adaptive_par_for(s.size(),[&](unsigned int i)
+    tipl::adaptive_par_for(s.size(),[&](size_t i)
     {
-        for(const auto& each : maps)
-            mapping[i] += each[i];
+        mapping[i] += count[i];
     });
-
 }
 //---------------------------------------------------------------------------
 void TractModel::get_density_map(
@@ -2524,7 +2744,7 @@ void TractModel::get_density_map(
         const tipl::matrix<4,4>& to_t1t2,bool endpoint)
 {
     tipl::shape<3> geo = mapping.shape();
-    tipl::image<3> map_r(geo),map_g(geo),map_b(geo);
+    atomic_volume<float> map_r(geo.size()),map_g(geo.size()),map_b(geo.size());
     std::cout << "aggregating tracts to voxels" << std::endl;
     tipl::par_for (tract_data.size(),[&](unsigned int i)
     {
@@ -2543,9 +2763,9 @@ void TractModel::get_density_map(
             if (!geo.is_valid(ipos))
                 continue;
             size_t ptr = tipl::voxel2index(ipos.begin(),mapping.shape());
-            map_r[ptr] += std::fabs(dir[0]);
-            map_g[ptr] += std::fabs(dir[1]);
-            map_b[ptr] += std::fabs(dir[2]);
+            map_r.add(ptr,std::fabs(dir[0]));
+            map_g.add(ptr,std::fabs(dir[1]));
+            map_b.add(ptr,std::fabs(dir[2]));
         }
     });
     std::cout << "generating rgb maps" << std::endl;
@@ -2574,7 +2794,7 @@ bool TractModel::export_end_pdi(
     auto vs = tract_models.front()->vs;
     auto trans_to_mni = tract_models.front()->trans_to_mni;
     auto is_mni = tract_models.front()->is_mni;
-    tipl::image<3,uint32_t> p1_map(dim),p2_map(dim);
+    atomic_volume<uint32_t> p1_map(dim.size()),p2_map(dim.size());
     for(size_t index = 0;index < tract_models.size();++index)
     {
         std::vector<tipl::vector<3,short> > p1,p2;
@@ -2583,16 +2803,21 @@ bool TractModel::export_end_pdi(
         {
             tipl::vector<3,short> p = p1[j];
             if(dim.is_valid(p))
-                p1_map[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()]++;
+                p1_map.add(tipl::pixel_index<3>(p[0],p[1],p[2],dim).index(),1);
         });
         tipl::adaptive_par_for(p2.size(),[&](size_t j)
         {
             tipl::vector<3,short> p = p2[j];
             if(dim.is_valid(p))
-                p2_map[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()]++;
+                p2_map.add(tipl::pixel_index<3>(p[0],p[1],p[2],dim).index(),1);
         });
     }
-    tipl::image<3> pdi1(p1_map),pdi2(p2_map);
+    tipl::image<3> pdi1(dim),pdi2(dim);
+    tipl::adaptive_par_for(pdi1.size(),[&](size_t i)
+    {
+        pdi1[i] = p1_map[i];
+        pdi2[i] = p2_map[i];
+    });
     if(tract_models.size() > 1)
     {
         tipl::multiply_constant(pdi1,1.0f/float(tract_models.size()));
@@ -2612,7 +2837,7 @@ bool TractModel::export_pdi(const char* file_name,
     auto vs = tract_models.front()->vs;
     auto trans_to_mni = tract_models.front()->trans_to_mni;
     auto is_mni = tract_models.front()->is_mni;
-    tipl::image<3,uint32_t> accumulate_map(dim);
+    atomic_volume<uint32_t> accumulate_map(dim.size());
     for(size_t index = 0;index < tract_models.size();++index)
     {
         std::vector<tipl::vector<3,short> > points;
@@ -2621,10 +2846,14 @@ bool TractModel::export_pdi(const char* file_name,
         {
             tipl::vector<3,short> p = points[j];
             if(dim.is_valid(p))
-                accumulate_map[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()]++;
+                accumulate_map.add(tipl::pixel_index<3>(p[0],p[1],p[2],dim).index(),1);
         });
     }
-    tipl::image<3> pdi(accumulate_map);
+    tipl::image<3> pdi(dim);
+    tipl::adaptive_par_for(pdi.size(),[&](size_t i)
+    {
+        pdi[i] = accumulate_map[i];
+    });
     if(tract_models.size() > 1)
         tipl::multiply_constant(pdi,1.0f/float(tract_models.size()));
     return tipl::io::gz_nifti::save_to_file(file_name,pdi,vs,trans_to_mni,is_mni);
@@ -3306,68 +3535,47 @@ float TractModel::get_tracts_mean(std::shared_ptr<fib_data> handle,unsigned int
     return tipl::mean(mean);
 }
 
-void TractModel::get_passing_list(const tipl::image<3,std::vector<short> >& region_map,
-                                  unsigned int region_count,
-                                  std::vector<std::vector<short> >& passing_list1,
-                                  std::vector<std::vector<short> >& passing_list2) const
+void TractModel::get_tract_regions(const region_label_map& region_map,unsigned int index,bool use_end_only,
+                                   std::vector<uint16_t>& regions1,
+                                   std::vector<uint16_t>& regions2) const
 {
-    passing_list1.clear();
-    passing_list1.resize(tract_data.size());
-    passing_list2.clear();
-    passing_list2.resize(tract_data.size());
-    // create regions maps
-
-    tipl::adaptive_par_for(tract_data.size(),[&](unsigned int index)
+    regions1.clear();
+    regions2.clear();
+    const auto& tract = tract_data[index];
+    if(tract.size() < 6)
+        return;
+    auto voxel_at = [&](size_t ptr)
     {
-        if(tract_data[index].size() < 6)
-            return;
-        std::vector<unsigned char> has_region(region_count);
-        for(unsigned int ptr = 0;ptr < tract_data[index].size();ptr += 3)
-        {
-            tipl::pixel_index<3> pos(std::round(tract_data[index][ptr]),
-                                        std::round(tract_data[index][ptr+1]),
-                                        std::round(tract_data[index][ptr+2]),geo);
-            if(!geo.is_valid(pos))
-                continue;
-            unsigned int pos_index = uint32_t(pos.index());
-            for(unsigned int j = 0;j < region_map[pos_index].size();++j)
-                has_region[uint32_t(region_map[pos_index][j])] = 1;
-        }
-        for(unsigned int i = 0;i < has_region.size();++i)
-            if(has_region[i])
-            {
-                passing_list1[index].push_back(short(i));
-                passing_list2[index].push_back(short(i));
-            }
-    });
-}
-
-void TractModel::get_end_list(const tipl::image<3,std::vector<short> >& region_map,
-                              std::vector<std::vector<short> >& end_pair1,
-                              std::vector<std::vector<short> >& end_pair2) const
-{
-    end_pair1.clear();
-    end_pair1.resize(tract_data.size());
-    end_pair2.clear();
-    end_pair2.resize(tract_data.size());
-    tipl::adaptive_par_for(tract_data.size(),[&](unsigned int index)
+        return tipl::pixel_index<3>(std::round(tract[ptr]),std::round(tract[ptr+1]),std::round(tract[ptr+2]),geo);
+    };
+    if(use_end_only)
     {
-        if(tract_data[index].size() < 6)
-            return;
-        tipl::pixel_index<3> end1(std::round(tract_data[index][0]),
-                                    std::round(tract_data[index][1]),
-                                    std::round(tract_data[index][2]),geo);
-        tipl::pixel_index<3> end2(std::round(tract_data[index][tract_data[index].size()-3]),
-                                    std::round(tract_data[index][tract_data[index].size()-2]),
-                                    std::round(tract_data[index][tract_data[index].size()-1]),geo);
+        auto end1 = voxel_at(0);
+        auto end2 = voxel_at(tract.size()-3);
         if(!geo.is_valid(end1) || !geo.is_valid(end2))
             return;
-        end_pair1[index] = region_map[end1.index()];
-        end_pair2[index] = region_map[end2.index()];
-    });
+        region_map.for_each(end1.index(),[&](uint16_t r){regions1.push_back(r);});
+        region_map.for_each(end2.index(),[&](uint16_t r){regions2.push_back(r);});
+        return;
+    }
+    size_t last_index = region_map.label.size();
+    for(size_t ptr = 0;ptr < tract.size();ptr += 3)
+    {
+        auto pos = voxel_at(ptr);
+        if(!geo.is_valid(pos) || pos.index() == last_index)
+            continue;
+        last_index = pos.index();
+        region_map.for_each(last_index,[&](uint16_t r)
+        {
+            if(regions1.empty() || regions1.back() != r)
+                regions1.push_back(r);
+        });
+    }
+    std::sort(regions1.begin(),regions1.end());
+    regions1.erase(std::unique(regions1.begin(),regions1.end()),regions1.end());
+    regions2 = regions1;
 }
 
-
 void TractModel::run_clustering(unsigned char method_id,unsigned int cluster_count,float detail)
 {
     float param[4] = {0};
@@ -3557,48 +3765,108 @@ void ConnectivityMatrix::set_parcellation(const Parcellation& p)
     auto geo = p.handle->dim;
     region_count = p.points.size();
     region_name = p.labels;
-    region_map.clear();
-    region_map.resize(geo);
-    for(size_t roi = 0;roi < p.points.size();++roi)
-        for(auto& pos : p.points[roi])
-            if(geo.is_valid(pos))
-                region_map.at(pos).push_back(uint16_t(roi));
+    region_map.build(geo,p.points);
     atlas_name = "roi";
 }
 
-
-template<class m_type>
-void init_matrix(m_type& m,unsigned int size)
+void region_label_map::build(const tipl::shape<3>& geo,const std::vector<std::vector<tipl::vector<3,short> > >& points)
 {
-    m.resize(size);
-    for(unsigned int i = 0;i < size;++i)
-        m[i].resize(size);
+    clear();
+    label.resize(geo);
+    std::fill(label.begin(),label.end(),no_region);
+    // (voxel,region) entries of voxels shared by more than one region
+    std::vector<std::pair<uint32_t,uint16_t> > shared;
+    for(size_t roi = 0;roi < points.size();++roi)
+        for(const auto& pos : points[roi])
+            if(geo.is_valid(pos))
+            {
+                auto index = uint32_t(tipl::pixel_index<3>(pos[0],pos[1],pos[2],geo).index());
+                auto& l = label[index];
+                if(l == no_region)
+                {
+                    l = uint32_t(roi);
+                    continue;
+                }
+                if(l == roi)
+                    continue;
+                if(!(l & overflow_flag))
+                {
+                    shared.push_back(std::make_pair(index,uint16_t(l)));
+                    l = overflow_flag;
+                }
+                shared.push_back(std::make_pair(index,uint16_t(roi)));
+            }
+    std::sort(shared.begin(),shared.end());
+    shared.erase(std::unique(shared.begin(),shared.end()),shared.end());
+    overflow_pos.push_back(0);
+    for(size_t i = 0;i < shared.size();)
+    {
+        auto index = shared[i].first;
+        label[index] = overflow_flag | uint32_t(overflow_pos.size()-1);
+        for(;i < shared.size() && shared[i].first == index;++i)
+            overflow_label.push_back(shared[i].second);
+        overflow_pos.push_back(uint32_t(overflow_label.size()));
+    }
 }
 
-template<class T,class fun_type>
-void for_each_connectivity(const T& end_list1,
-                           const T& end_list2,
-                           fun_type lambda_fun)
+
+// per-thread region_count-by-region_count matrices, allocated on first use
+template<class T>
+class thread_matrix{
+    std::vector<std::vector<T> > data;
+    size_t n;
+public:
+    thread_matrix(size_t n_):data(tipl::max_thread_count),n(n_){}
+    T& at(unsigned int id,unsigned int i,unsigned int j)
+    {
+        auto& m = data[id];
+        if(m.empty())
+            m.resize(n*n);
+        return m[i*n+j];
+    }
+    std::vector<T> sum(void) const
+    {
+        std::vector<T> result(n*n);
+        tipl::adaptive_par_for(result.size(),[&](size_t i)
+        {
+            for(const auto& m : data)
+                if(!m.empty())
+                    result[i] += m[i];
+        });
+        return result;
+    }
+};
+
+// calls fun(thread_id,tract_index,i,j) once for every ordered pair of distinct regions connected by a tract
+template<class fun_type>
+void for_each_connectivity(const TractModel& tract_model,
+                           const region_label_map& region_map,
+                           bool use_end_only,
+                           fun_type&& fun)
 {
-    for(unsigned int index = 0;index < end_list1.size();++index)
-    {
-        const auto& r1 = end_list1[index];
-        const auto& r2 = end_list2[index];
-        std::vector<std::pair<uint32_t,uint32_t> > region_pair;
-        for(unsigned int i = 0;i < r1.size();++i)
-            for(unsigned int j = 0;j < r2.size();++j)
-                if(r1[i] != r2[j])
+    struct buffer{
+        std::vector<uint16_t> r1,r2;
+        std::vector<std::pair<uint16_t,uint16_t> > region_pair;
+    };
+    std::vector<buffer> buffers(tipl::max_thread_count);
+    tipl::par_for<tipl::sequential_with_id>(tract_model.get_tracts().size(),[&](size_t index,unsigned int id)
+    {
+        auto& b = buffers[id];
+        tract_model.get_tract_regions(region_map,uint32_t(index),use_end_only,b.r1,b.r2);
+        b.region_pair.clear();
+        for(auto r1 : b.r1)
+            for(auto r2 : b.r2)
+                if(r1 != r2)
                 {
-                    region_pair.push_back(std::make_pair(uint32_t(r1[i]),uint32_t(r2[j])));
-                    region_pair.push_back(std::make_pair(uint32_t(r2[j]),uint32_t(r1[i])));
+                    b.region_pair.push_back(std::make_pair(r1,r2));
+                    b.region_pair.push_back(std::make_pair(r2,r1));
                 }
         // remove duplicates
-        std::sort(region_pair.begin(), region_pair.end());
-        region_pair.erase(std::unique(region_pair.begin(), region_pair.end()), region_pair.end());
-
-        for(const auto& pair : region_pair)
-            lambda_fun(index,pair.first,pair.second);
-    }
+        std::sort(b.region_pair.begin(),b.region_pair.end());
+        b.region_pair.erase(std::unique(b.region_pair.begin(),b.region_pair.end()),b.region_pair.end());
+        for(const auto& pair : b.region_pair)
+            fun(id,uint32_t(index),uint32_t(pair.first),uint32_t(pair.second));
+    });
 }
 
 bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
@@ -3617,48 +3885,49 @@ bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
         return false;
     }
 
-    std::vector<std::vector<short> > end_list1,end_list2;
-    if(use_end_only)
-        tract_model.get_end_list(region_map,end_list1,end_list2);
-    else
-        tract_model.get_passing_list(region_map,uint32_t(region_count),end_list1,end_list2);
-
     matrix_value.clear();
     matrix_value.resize(tipl::shape<2>(uint32_t(region_count),uint32_t(region_count)));
 
     if(tipl::begins_with(matrix_value_type,"trk"))
     {
-        std::vector<std::vector<std::vector<unsigned int> > > region_passing_list;
-        init_matrix(region_passing_list,uint32_t(region_count));
-
-        for_each_connectivity(end_list1,end_list2,
-                              [&](unsigned int index,unsigned int i,unsigned int j){
-            region_passing_list[i][j].push_back(index);
+        // (i*region_count+j,tract index) for i < j
+        std::vector<std::vector<std::pair<size_t,uint32_t> > > region_tracts_threads(tipl::max_thread_count);
+        for_each_connectivity(tract_model,region_map,use_end_only,
+                              [&](unsigned int id,unsigned int index,unsigned int i,unsigned int j){
+            if(i < j)
+                region_tracts_threads[id].push_back(std::make_pair(size_t(i)*region_count+j,index));
         });
+        std::vector<std::pair<size_t,uint32_t> > region_tracts;
+        tipl::aggregate_results(std::move(region_tracts_threads),region_tracts);
+        std::sort(region_tracts.begin(),region_tracts.end());
 
         const float resolution_ratio = 2.0f;
         tipl::matrix<4,4> resolution_trans((tipl::identity_matrix()));
         resolution_trans[0] = resolution_trans[5] = resolution_trans[10] = 2.0f;
 
-        std::vector<std::pair<size_t,size_t> > ij_pair;
-        for(unsigned int i = 0;i < region_passing_list.size();++i)
-            for(unsigned int j = i+1;j < region_passing_list.size();++j)
-                if(!region_passing_list[i][j].empty())
-                    ij_pair.push_back(std::make_pair(i,j));
+        // ranges of region_tracts sharing the same region pair
+        std::vector<std::pair<size_t,size_t> > ij_range;
+        for(size_t k = 0;k < region_tracts.size();)
+        {
+            size_t from = k;
+            for(;k < region_tracts.size() && region_tracts[k].first == region_tracts[from].first;++k)
+                ;
+            ij_range.push_back(std::make_pair(from,k));
+        }
 
         bool return_value = true;
-        tipl::adaptive_par_for(ij_pair.size(),[&](size_t index)
+        tipl::adaptive_par_for(ij_range.size(),[&](size_t index)
         {
-            auto i = ij_pair[index].first;
-            auto j = ij_pair[index].second;
+            auto i = region_tracts[ij_range[index].first].first/region_count;
+            auto j = region_tracts[ij_range[index].first].first%region_count;
             TractModel tm(tract_model.geo,tract_model.vs);
             tm.report = tract_model.report;
             tm.trans_to_mni = tract_model.trans_to_mni;
             tm.is_mni = tract_model.is_mni;
 
             std::vector<std::vector<float> > new_tracts;
-            for (unsigned int k = 0;k < region_passing_list[i][j].size();++k)
-                new_tracts.push_back(tract_model.get_tract(region_passing_list[i][j][k]));
+            for (size_t k = ij_range[index].first;k < ij_range[index].second;++k)
+                new_tracts.push_back(tract_model.get_tract(region_tracts[k].second));
             tm.add_tracts(new_tracts);
             if(matrix_value_type == "trk")
             {
@@ -3683,109 +3952,104 @@ bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
         return return_value;
     }
 
-    std::vector<std::vector<unsigned int> > count;
-    init_matrix(count,uint32_t(region_count));
-    for_each_connectivity(end_list1,end_list2,
-                          [&](unsigned int,unsigned int i,unsigned int j){
-        ++count[i][j];
+    std::vector<std::vector<float> > data;
+    std::vector<float> mean_data;
+    bool is_ncount = (matrix_value_type == "ncount" || matrix_value_type == "ncount2");
+    bool is_mean_length = (matrix_value_type == "mean_length");
+    bool is_mean_data = (matrix_value_type != "count" && !is_ncount && !is_mean_length);
+    if(is_mean_data)
+    {
+        data = tract_model.get_tracts_data(handle,matrix_value_type);
+        if(data.empty())
+        {
+            error_msg = "Cannot quantify matrix value using ";
+            error_msg += matrix_value_type;
+            return false;
+        }
+        mean_data.resize(data.size());
+        for(unsigned int index = 0;index < data.size();++index)
+            if(!data[index].empty())
+                mean_data[index] = float(tipl::mean(data[index].begin(),data[index].end()));
+    }
+
+    // all values are accumulated in one pass through the tracts
+    thread_matrix<unsigned int> count_threads(region_count);
+    thread_matrix<float> sum_threads(is_ncount ? 0 : region_count);
+    thread_matrix<unsigned int> sum_n_threads(is_mean_length ? region_count : 0);
+    // (i*region_count+j,tract length) for ncount
+    std::vector<std::vector<std::pair<size_t,uint32_t> > > length_threads(tipl::max_thread_count);
+    for_each_connectivity(tract_model,region_map,use_end_only,
+                          [&](unsigned int id,unsigned int index,unsigned int i,unsigned int j){
+        ++count_threads.at(id,i,j);
+        if(is_ncount)
+            length_threads[id].push_back(std::make_pair(size_t(i)*region_count+j,uint32_t(tract_model.get_tract(index).size())));
+        if(is_mean_length)
+        {
+            auto num_steps = tract_model.get_tract(index).size();
+            if(num_steps >= 6)
+            {
+                auto dis = tract_model.get_tract_point(index,0)-tract_model.get_tract_point(index,1);
+                tipl::multiply(dis,handle->vs);
+                sum_threads.at(id,i,j) += dis.length()*num_steps;
+                ++sum_n_threads.at(id,i,j);
+            }
+        }
+        if(is_mean_data)
+            sum_threads.at(id,i,j) += mean_data[index];
     });
+    auto count = count_threads.sum();
 
     // determine the threshold for counting the connectivity
     tipl::out() << "threshold: " << threshold;
     unsigned int threshold_count = 0;
-    for (const auto& inner : count)
-        for (const auto& val : inner)
-            threshold_count = std::max(threshold_count, val);
+    for (const auto& val : count)
+        threshold_count = std::max(threshold_count, val);
     threshold_count *= threshold;
 
     if(matrix_value_type == "count")
     {
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                matrix_value[index] = (count[i][j] > threshold_count ? count[i][j] : 0);
+        for(size_t index = 0;index < count.size();++index)
+            matrix_value[index] = (count[index] > threshold_count ? count[index] : 0);
         return true;
     }
-    if(matrix_value_type == "ncount" || matrix_value_type == "ncount2")
+    if(is_ncount)
     {
-        std::vector<std::vector<std::vector<unsigned int> > > length_matrix;
-        init_matrix(length_matrix,uint32_t(region_count));
-
-        for_each_connectivity(end_list1,end_list2,
-                              [&](unsigned int index,unsigned int i,unsigned int j){
-            length_matrix[i][j].push_back(uint32_t(tract_model.get_tract(index).size()));
-        });
-
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                if(!length_matrix[i][j].empty() && count[i][j] > threshold_count)
-                {
-                    float length = 0.0;
-                    if(matrix_value_type == "ncount")
-                        length = 1.0f/tipl::median(length_matrix[i][j].begin(),length_matrix[i][j].end());
-                    else
-                    {
-                        for(unsigned int k = 0;k < length_matrix[i][j].size();++k)
-                            length += 1.0f/length_matrix[i][j][k];
-                    }
-                    matrix_value[index] = count[i][j]*length;
-                }
-                else
-                    matrix_value[index] = 0;
-
-        return true;
-    }
-
-
-    if(matrix_value_type == "mean_length")
-    {
-        std::vector<std::vector<float> > sum_length;
-        std::vector<std::vector<unsigned int> > sum_n;
-        init_matrix(sum_length,uint32_t(region_count));
-        init_matrix(sum_n,uint32_t(region_count));
-
-        for_each_connectivity(end_list1,end_list2,
-                              [&](unsigned int index,unsigned int i,unsigned int j){
-            auto num_steps = tract_model.get_tract(index).size();
-            if(num_steps >= 6)
+        std::vector<std::pair<size_t,uint32_t> > length_list;
+        tipl::aggregate_results(std::move(length_threads),length_list);
+        std::sort(length_list.begin(),length_list.end());
+        for(size_t k = 0;k < length_list.size();)
+        {
+            auto index = length_list[k].first;
+            std::vector<unsigned int> length_matrix;
+            for(;k < length_list.size() && length_list[k].first == index;++k)
+                length_matrix.push_back(length_list[k].second);
+            if(count[index] <= threshold_count)
+                continue;
+            float length = 0.0;
+            if(matrix_value_type == "ncount")
+                length = 1.0f/tipl::median(length_matrix.begin(),length_matrix.end());
+            else
             {
-                auto dis = tract_model.get_tract_point(index,0)-tract_model.get_tract_point(index,1);
-                tipl::multiply(dis,handle->vs);
-                sum_length[i][j] += dis.length()*num_steps;
-                ++sum_n[i][j];
+                for(unsigned int l = 0;l < length_matrix.size();++l)
+                    length += 1.0f/length_matrix[l];
             }
-
-        });
-
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                if(sum_n[i][j] && count[i][j] > threshold_count)
-                    matrix_value[index] = float(sum_length[i][j])/float(sum_n[i][j])/3.0f;
+            matrix_value[index] = count[index]*length;
+        }
         return true;
     }
-    std::vector<std::vector<float> > data(tract_model.get_tracts_data(handle,matrix_value_type));
-    if(data.empty())
+
+    auto sum = sum_threads.sum();
+    if(is_mean_length)
     {
-        error_msg = "Cannot quantify matrix value using ";
-        error_msg += matrix_value_type;
-        return false;
+        auto sum_n = sum_n_threads.sum();
+        for(size_t index = 0;index < count.size();++index)
+            if(sum_n[index] && count[index] > threshold_count)
+                matrix_value[index] = float(sum[index])/float(sum_n[index])/3.0f;
+        return true;
     }
-    std::vector<std::vector<float> > sum;
-    init_matrix(sum,uint32_t(region_count));
-
-    std::vector<float> m(data.size());
-    for(unsigned int index = 0;index < data.size();++index)
-        if(!data[index].empty())
-            m[index] = float(tipl::mean(data[index].begin(),data[index].end()));
-
-    for_each_connectivity(end_list1,end_list2,
-                          [&](unsigned int index,unsigned int i,unsigned int j){
-        sum[i][j] += m[index];
-    });
-
 
-    for(unsigned int i = 0,index = 0;i < count.size();++i)
-        for(unsigned int j = 0;j < count[i].size();++j,++index)
-            matrix_value[index] = (count[i][j] > threshold_count ? sum[i][j]/float(count[i][j]) : 0.0f);
+    for(size_t index = 0;index < count.size();++index)
+        matrix_value[index] = (count[index] > threshold_count ? sum[index]/float(count[index]) : 0.0f);
     return true;
 
 }
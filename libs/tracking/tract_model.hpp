@@ -5,7 +5,52 @@
 #include "fib_data.hpp"
 
 class RoiMgr;
+// streamlines stored back to back in one coordinate arena,
+// tract i occupies data[pos[i]] to data[pos[i+1]].
+// used as the output buffer of tracking threads; TractModel keeps one vector per tract
+struct tract_arena{
+    std::vector<float> data;
+    std::vector<size_t> pos = {0};
+    size_t size(void) const{return pos.size()-1;}
+    bool empty(void) const{return pos.size() == 1;}
+    void clear(void){data.clear();pos.resize(1);}
+    const float* begin(size_t i) const{return data.data()+pos[i];}
+    const float* end(size_t i) const{return data.data()+pos[i+1];}
+    size_t tract_size(size_t i) const{return pos[i+1]-pos[i];}
+    void push_back(const float* from,const float* to)
+    {
+        data.insert(data.end(),from,to);
+        pos.push_back(data.size());
+    }
+};
 void initial_LPS_nifti_srow(tipl::matrix<4,4>& T,const tipl::shape<3>& geo,const tipl::vector<3>& vs);
+// region labels of each voxel: one label per voxel, and voxels shared by
+// overlapping regions point to their label lists in a CSR overflow
+struct region_label_map{
+    static constexpr uint32_t no_region = 0xFFFFFFFF;
+    static constexpr uint32_t overflow_flag = 0x80000000;
+    tipl::image<3,uint32_t> label;
+    std::vector<uint32_t> overflow_pos;
+    std::vector<uint16_t> overflow_label;
+    void clear(void){label.clear();overflow_pos.clear();overflow_label.clear();}
+    void build(const tipl::shape<3>& geo,const std::vector<std::vector<tipl::vector<3,short> > >& points);
+    template<class fun_type>
+    void for_each(size_t index,fun_type&& fun) const
+    {
+        auto l = label[index];
+        if(l == no_region)
+            return;
+        if(!(l & overflow_flag))
+        {
+            fun(uint16_t(l));
+            return;
+        }
+        l &= ~overflow_flag;
+        for(auto i = overflow_pos[l];i < overflow_pos[l+1];++i)
+            fun(overflow_label[i]);
+    }
+};
+
 class TractModel{
 public:
         std::string report,name,parameter_id;
@@ -127,7 +172,9 @@ public:
             return *this;
         }
         void add(const TractModel& rhs);
-        bool load_tracts_from_file(const char* file_name,fib_data* handle,bool tract_is_mni = false);
+        // from and to select tracts [from,to) of the file
+        bool load_tracts_from_file(const char* file_name,fib_data* handle,bool tract_is_mni = false,
+                                   size_t from = 0,size_t to = SIZE_MAX);
 
         bool save_tracts_to_file(const char* file_name);
         bool save_tracts_in_template_space(std::shared_ptr<fib_data> handle,const char* file_name,bool output_mni = false);
@@ -150,6 +197,8 @@ public:
         void add_tracts(std::vector<std::vector<float> >& new_tracks);
         void add_tracts(std::vector<std::vector<float> >& new_tracks,tipl::rgb color);
         void add_tracts(std::vector<std::vector<float> >& new_tracks,unsigned int length_threshold,tipl::rgb color);
+        void add_tracts(const tract_arena& new_tracks);
+        void add_tracts(const tract_arena& new_tracks,unsigned int length_threshold,tipl::rgb color);
         bool filter_by_roi(std::shared_ptr<RoiMgr> roi_mgr);
         bool reconnect_track(float distance,float angular_threshold);
         bool cull(float select_angle,
@@ -232,13 +281,9 @@ public:
         float get_tracts_mean(std::shared_ptr<fib_data> handle,unsigned int index_num) const;
 public:
 
-        void get_passing_list(const tipl::image<3,std::vector<short> >& region_map,
-                              unsigned int region_count,
-                                     std::vector<std::vector<short> >& passing_list1,
-                                     std::vector<std::vector<short> >& passing_list2) const;
-        void get_end_list(const tipl::image<3,std::vector<short> >& region_map,
-                                     std::vector<std::vector<short> >& end_list1,
-                                     std::vector<std::vector<short> >& end_list2) const;
+        void get_tract_regions(const region_label_map& region_map,unsigned int index,bool use_end_only,
+                               std::vector<uint16_t>& regions1,
+                               std::vector<uint16_t>& regions2) const;
         void run_clustering(unsigned char method_id,unsigned int cluster_count,float param);
 
 };
@@ -270,7 +315,7 @@ public:
 
     tipl::image<2> matrix_value;
 public:
-    tipl::image<3,std::vector<short> > region_map;
+    region_label_map region_map;
     size_t region_count = 0;
     std::vector<std::string> region_name;
     std::string error_msg,atlas_name;